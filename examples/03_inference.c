@@ -27,7 +27,7 @@ void prepare(void) {
   samples[Idx].input.at = input##Idx;                                          \
   samples[Idx].target.len = 11;                                                \
   for (int i = 0; i < 11; i++) {                                               \
-    target##Idx[i] = vfrom(i == Idx ? 1.0 : -1.0);                             \
+    target##Idx[i] = vconst(i == Idx ? 1.0 : -1.0);                            \
   }                                                                            \
   samples[Idx].target.at = target##Idx;
 
@@ -56,7 +56,7 @@ void prepare(void) {
   samples[Idx].input.at = input##Idx;                                          \
   samples[Idx].target.len = 11;                                                \
   for (int i = 0; i < 11; i++) {                                               \
-    target##Idx[i] = vfrom(i == 10 ? 1.0 : -1.0);                              \
+    target##Idx[i] = vconst(i == 10 ? 1.0 : -1.0);                             \
   }                                                                            \
   samples[Idx].target.at = target##Idx;
 
@@ -75,7 +75,8 @@ void prompt(net_t *net, vec_t *result, idx_t mark) {
     printf("enter a 7-bit sequence (e.g., 0110000 for 1, 1101101 for 2): ");
 
     char buf[16];
-    fgets(buf, sizeof(buf), stdin);
+    if (!fgets(buf, sizeof(buf), stdin))
+      return;
 
     char raw[7];
     size_t rlen = 0;
@@ -113,7 +114,7 @@ void prompt(net_t *net, vec_t *result, idx_t mark) {
 }
 
 idx_t squarederror(vec_t *result, vec_t *target) {
-  idx_t loss = vfrom(0);
+  idx_t loss = vconst(0);
   for (int k = 0; k < 11; k++) {
     idx_t yk = result->at[k];
     idx_t tk = target->at[k];
@@ -125,7 +126,7 @@ idx_t squarederror(vec_t *result, vec_t *target) {
 }
 
 int main(void) {
-  // See examples/04_training for a malloc example
+  // See examples/02_training for a malloc example
   static char tapebuf[1 << 16];
   tapeinit(SIZE, sizeof(tapebuf), tapebuf);
 
@@ -133,10 +134,14 @@ int main(void) {
 
   net_t net;
   len_t llens[3] = {7, 8, 11};
-  // See examples/04_training for a malloc example
-  static char netbuf[1 << 11];
+  // The network takes a buffer sized from netsize. See examples/01_network
+  // for netcreate
+  len_t netsz = netsize(len(llens), llens);
+  char *netbuf = malloc(netsz);
+  if (!netbuf)
+    return 1;
 
-  netinit(&net, len(llens), llens, sizeof(netbuf), netbuf);
+  netinit(&net, len(llens), llens, netsz, netbuf);
 
   idx_t mark = tapemark();
 
@@ -169,5 +174,6 @@ int main(void) {
   }
 
   prompt(&net, &result, mark);
+  free(netbuf);
   return 0;
 }
@@ -1,5 +1,6 @@
 #include "../gradino.h"
 #include <string.h>
+#include <time.h>
 
 #define len(Arr) sizeof(Arr) / sizeof(Arr[0])
 
@@ -161,7 +162,7 @@ static void play(net_t *net, idx_t mark) {
         tapereset(mark);
 
         for (int i = 0; i < CELLS; i++)
-          idata[i] = vfrom((value_t)board[i]);
+          idata[i] = vconst((value_t)board[i]);
         netfwd(net, &input, &result);
 
         int maxscorecell = -1;
@@ -199,60 +200,69 @@ static void play(net_t *net, idx_t mark) {
   }
 }
 
+static bool report(len_t epoch, value_t loss, void *ctx) {
+  (void)ctx;
+#ifndef NDEBUG
+  printf("epoch %lu avg loss: %f\n", epoch, loss);
+#else
+  (void)epoch;
+  (void)loss;
+#endif
+  return true;
+}
+
 int main(void) {
+  srand((unsigned)time(NULL));
+
   // Generate training data from minimax
   int board[CELLS] = {0};
   generate(board, 1);
   printf("Generated %d training positions.\n", nsamples);
 
-  static char tapebuf[1 << 19];
-  tapeinit(1 << 13, sizeof(tapebuf), tapebuf);
+  static value_t inputs[MAX_SAMPLES][CELLS];
+  static value_t targets[MAX_SAMPLES][CELLS];
+  for (int s = 0; s < nsamples; s++) {
+    for (int i = 0; i < CELLS; i++) {
+      inputs[s][i] = (value_t)samples[s].cells[i];
+      targets[s][i] = i == samples[s].move ? 1.0 : -1.0;
+    }
+  }
 
-  net_t net;
+  // One buffer holds the tape, the network and the netfit buffer. Moves only
+  // record the forward pass over the two interned cell values.
   len_t llens[3] = {CELLS, 27, CELLS};
-  static char netbuf[1 << 14];
-  netinit(&net, len(llens), llens, sizeof(netbuf), netbuf);
-
-  idx_t mark = tapemark();
-  vec_t result;
-  idx_t rdata[CELLS];
-  vecinit(&result, CELLS, rdata);
+  arena_t arena = {0};
+  arena.nlens = len(llens);
+  arena.llens = llens;
+  arena.consts = 2;
+  arena.fit = (len_t)nsamples;
+  void *arenabuf = arenacreate(&arena);
+  if (!arenabuf)
+    return 1;
+  net_t *net = &arena.net;
+
+  // Samples are visited in order, to stay comparable with
+  // benchmark/04_tictactoe.py
+  fit_t fit = {0};
+  fit.inputs = &inputs[0][0];
+  fit.targets = &targets[0][0];
+  fit.nsamples = (len_t)nsamples;
+  fit.epochs = EPOCHS;
+  fit.batch = 1;
+  fit.rate = 0.005;
+  fit.loss = LOSS_SQUARED;
+  fit.onepoch = report;
 
   puts("Training the network. This might take some seconds...");
-  for (int epoch = 0; epoch < EPOCHS; epoch++) {
-#ifndef NDEBUG
-    value_t epoch_sum = 0.0;
-#endif
-    for (int s = 0; s < nsamples; s++) {
-      tapereset(mark);
-
-      idx_t idata[CELLS];
-      for (int i = 0; i < CELLS; i++)
-        idata[i] = vfrom((value_t)samples[s].cells[i]);
-      vec_t input;
-      vecinit(&input, CELLS, idata);
-
-      netfwd(&net, &input, &result);
-
-      idx_t loss = vfrom(0);
-      for (int i = 0; i < CELLS; i++) {
-        idx_t target = vfrom(i == samples[s].move ? 1.0 : -1.0);
-        idx_t diff = vsub(target, result.at[i]);
-        loss = vadd(loss, vmul(diff, diff));
-      }
+  netfit(net, &fit, arena.nfitbuf, arena.fitbuf);
 
-#ifndef NDEBUG
-      epoch_sum += tapeval(loss);
-#endif
-      tapezerograd();
-      tapebackprop(loss);
-      netgdstep(&net, 0.005);
-    }
-#ifndef NDEBUG
-    printf("epoch %d avg loss: %f\n", epoch, epoch_sum / nsamples);
-#endif
-  }
+  // Intern the cell values before the mark: vconst will then reuse them for
+  // every move instead of recording new constants
+  vconst(1.0);
+  vconst(-1.0);
 
-  play(&net, mark);
+  idx_t mark = tapemark();
+  play(net, mark);
+  GRADINO_FREE(arenabuf);
   return 0;
 }
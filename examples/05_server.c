@@ -0,0 +1,215 @@
+// Batching inference server over a Unix domain socket.
+//
+// Requests arriving within a time window are coalesced into one batch and run
+// through netinfer, then the results are scattered back. A wider window means
+// bigger batches and more throughput, at the cost of latency. Measure the
+// trade-off with examples/06_loadgen.
+//
+// Protocol: on connect the server sends the input and output widths as two
+// uint32_t. Then each request is one row of value_t inputs, and each response
+// one row of value_t outputs.
+//
+//   ./examples/05_server [socket] [window_us] [model]
+//
+// Without a model file (see netsave) the network has random parameters.
+#define _POSIX_C_SOURCE 200809L
+#include "../gradino.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define len(Arr) sizeof(Arr) / sizeof(Arr[0])
+
+enum { MAX_CLIENTS = 128, NIN = 16, NOUT = 4 };
+
+static volatile sig_atomic_t running = 1;
+static void onsignal(int sig) {
+  (void)sig;
+  running = 0;
+}
+
+static long long now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Read or write exactly n bytes. Returns false on errors or end of file.
+static bool readall(int fd, void *buf, size_t n) {
+  char *p = buf;
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= (size_t)r;
+  }
+  return true;
+}
+
+static bool writeall(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  while (n > 0) {
+    ssize_t r = write(fd, p, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= (size_t)r;
+  }
+  return true;
+}
+
+// A client with a request in the current batch is not polled until it got its
+// response: its descriptor is stored negated, which poll ignores, so neither
+// a second request nor a hang-up wakes the server before then.
+static int queued(int fd) { return -1 - fd; }
+
+typedef struct {
+  struct pollfd fds[MAX_CLIENTS + 1]; // fds[0] is the listening socket
+  nfds_t nfds;
+  int owners[MAX_CLIENTS]; // client of each batch row
+  value_t inputs[MAX_CLIENTS][NIN];
+  value_t outputs[MAX_CLIENTS][NOUT];
+  len_t count;
+} server_t;
+
+static void drop(server_t *s, nfds_t i) {
+  close(s->fds[i].fd);
+  s->fds[i] = s->fds[--s->nfds];
+}
+
+static void accept_client(server_t *s) {
+  int fd = accept(s->fds[0].fd, NULL, NULL);
+  if (fd < 0)
+    return;
+  uint32_t hello[2] = {NIN, NOUT};
+  if (s->nfds == len(s->fds) || !writeall(fd, hello, sizeof(hello))) {
+    close(fd);
+    return;
+  }
+  s->fds[s->nfds].fd = fd;
+  s->fds[s->nfds].events = POLLIN;
+  // The slot may hold the events of a client dropped in this same poll
+  s->fds[s->nfds].revents = 0;
+  s->nfds++;
+}
+
+// Poll for at most timeout milliseconds, then queue the requests that arrived
+static void collect(server_t *s, int timeout) {
+  if (poll(s->fds, s->nfds, timeout) <= 0)
+    return;
+
+  if (s->fds[0].revents & POLLIN)
+    accept_client(s);
+
+  for (nfds_t i = 1; i < s->nfds; i++) {
+    if (!(s->fds[i].revents & (POLLIN | POLLHUP)))
+      continue;
+    if (!readall(s->fds[i].fd, s->inputs[s->count], sizeof(s->inputs[0]))) {
+      drop(s, i--);
+      continue;
+    }
+    s->owners[s->count++] = s->fds[i].fd;
+    s->fds[i].fd = queued(s->fds[i].fd);
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "/tmp/gradino.sock";
+  long long window = argc > 2 ? atoll(argv[2]) : 200;
+  const char *model = argc > 3 ? argv[3] : NULL;
+
+  void *tapebuf = tapecreate(1 << 16);
+  if (!tapebuf)
+    return 1;
+  len_t llens[] = {NIN, 64, 64, NOUT};
+  net_t *net = netcreate(len(llens), llens);
+  if (!net)
+    return 1;
+  if (model && netload(net, model) != 0) {
+    fprintf(stderr, "cannot load model %s\n", model);
+    return 1;
+  }
+
+  size_t nbuf = infersize(net, MAX_CLIENTS);
+  char *buf = malloc(nbuf);
+  if (!buf)
+    return 1;
+
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(lfd, MAX_CLIENTS) != 0) {
+    perror("listen");
+    return 1;
+  }
+
+  struct sigaction sa = {0};
+  sa.sa_handler = onsignal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  static server_t s;
+  s.fds[0].fd = lfd;
+  s.fds[0].events = POLLIN;
+  s.nfds = 1;
+  printf("listening on %s (window %lldus)\n", path, window);
+  fflush(stdout);
+
+  unsigned long long batches = 0;
+  unsigned long long requests = 0;
+  while (running) {
+    // The window opens with the first request of a batch
+    s.count = 0;
+    while (running && s.count == 0) {
+      collect(&s, -1);
+    }
+    long long deadline = now() + window;
+    for (long long left; running && s.count < s.nfds - 1 &&
+                         (left = deadline - now()) > 0;) {
+      collect(&s, (int)((left + 999) / 1000));
+    }
+    if (s.count == 0)
+      break;
+
+    netinfer(net, &s.inputs[0][0], s.count, &s.outputs[0][0], (len_t)nbuf,
+             buf);
+
+    for (len_t r = 0; r < s.count; r++) {
+      for (nfds_t i = 1; i < s.nfds; i++) {
+        if (s.fds[i].fd != queued(s.owners[r]))
+          continue;
+        s.fds[i].fd = s.owners[r];
+        if (!writeall(s.owners[r], s.outputs[r], sizeof(s.outputs[0])))
+          drop(&s, i);
+        break;
+      }
+    }
+    batches++;
+    requests += s.count;
+  }
+
+  printf("\n%llu requests in %llu batches (%.2f per batch)\n", requests,
+         batches, batches ? (double)requests / (double)batches : 0.0);
+  for (nfds_t i = 0; i < s.nfds; i++) {
+    close(s.fds[i].fd);
+  }
+  unlink(path);
+  free(buf);
+  GRADINO_FREE(net);
+  GRADINO_FREE(tapebuf);
+  return 0;
+}
@@ -0,0 +1,161 @@
+// Load generator for examples/05_server.
+//
+// Every connection is a closed loop: it sends a request, waits for the
+// response, and sends the next one. At the end the latency percentiles and
+// the overall throughput are reported.
+//
+//   ./examples/06_loadgen [socket] [connections] [seconds]
+#define _POSIX_C_SOURCE 200809L
+#include "../gradino.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { MAX_CONNS = 128, MAX_WIDTH = 1024, MAX_SAMPLES = 1 << 20 };
+
+static const char *path;
+static long long duration;
+
+static long long now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool readall(int fd, void *buf, size_t n) {
+  char *p = buf;
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= (size_t)r;
+  }
+  return true;
+}
+
+static bool writeall(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  while (n > 0) {
+    ssize_t r = write(fd, p, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= (size_t)r;
+  }
+  return true;
+}
+
+typedef struct {
+  long long *latencies; // microseconds
+  size_t count;
+  unsigned seed;
+} conn_t;
+
+static void *run(void *arg) {
+  conn_t *c = arg;
+
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  uint32_t hello[2];
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      !readall(fd, hello, sizeof(hello)) || hello[0] > MAX_WIDTH ||
+      hello[1] > MAX_WIDTH) {
+    perror("connect");
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+
+  value_t input[MAX_WIDTH], output[MAX_WIDTH];
+  long long end = now() + duration;
+  while (c->count < MAX_SAMPLES) {
+    for (uint32_t i = 0; i < hello[0]; i++) {
+      c->seed = c->seed * 1103515245u + 12345u;
+      input[i] = (value_t)(c->seed >> 16) / 32768.0 - 1.0;
+    }
+
+    long long start = now();
+    if (start >= end ||
+        !writeall(fd, input, sizeof(value_t) * hello[0]) ||
+        !readall(fd, output, sizeof(value_t) * hello[1]))
+      break;
+    c->latencies[c->count++] = now() - start;
+  }
+
+  close(fd);
+  return NULL;
+}
+
+static int compare(const void *a, const void *b) {
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+  path = argc > 1 ? argv[1] : "/tmp/gradino.sock";
+  int nconns = argc > 2 ? atoi(argv[2]) : 16;
+  duration = (argc > 3 ? atoll(argv[3]) : 5) * 1000000;
+  if (nconns < 1 || nconns > MAX_CONNS) {
+    fprintf(stderr, "connections must be between 1 and %d\n", MAX_CONNS);
+    return 1;
+  }
+
+  static conn_t conns[MAX_CONNS];
+  static pthread_t threads[MAX_CONNS];
+  for (int i = 0; i < nconns; i++) {
+    conns[i].latencies = malloc(sizeof(long long) * MAX_SAMPLES);
+    if (!conns[i].latencies)
+      return 1;
+    conns[i].seed = (unsigned)i + 1;
+  }
+
+  long long start = now();
+  for (int i = 0; i < nconns; i++) {
+    pthread_create(&threads[i], NULL, run, &conns[i]);
+  }
+  for (int i = 0; i < nconns; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  long long elapsed = now() - start;
+
+  size_t total = 0;
+  for (int i = 0; i < nconns; i++) {
+    total += conns[i].count;
+  }
+  if (total == 0) {
+    fprintf(stderr, "no request completed\n");
+    return 1;
+  }
+
+  long long *all = malloc(sizeof(long long) * total);
+  if (!all)
+    return 1;
+  size_t offset = 0;
+  for (int i = 0; i < nconns; i++) {
+    memcpy(all + offset, conns[i].latencies,
+           sizeof(long long) * conns[i].count);
+    offset += conns[i].count;
+    free(conns[i].latencies);
+  }
+  qsort(all, total, sizeof(long long), compare);
+
+  printf("connections: %d\n", nconns);
+  printf("requests:    %zu\n", total);
+  printf("qps:         %.0f\n", (double)total * 1e6 / (double)elapsed);
+  printf("p50:         %lldus\n", all[total / 2]);
+  printf("p99:         %lldus\n", all[total * 99 / 100]);
+  free(all);
+  return 0;
+}
@@ -0,0 +1,91 @@
+// Training loop benchmark.
+//
+// The loop records from this file too: features are expanded with pairwise
+// products and the loss is summed with vadd/vmul, as typical training code
+// does. Compare the separate-object build with the single-header one, where
+// those calls can be inlined:
+//
+//   make bench
+//
+// With a library built with make PERF=1, hardware events are also counted in
+// each phase of the step and reported per step.
+#define _POSIX_C_SOURCE 200809L
+#include "../gradino.h"
+#include <math.h>
+#include <time.h>
+
+#define len(Arr) sizeof(Arr) / sizeof(Arr[0])
+
+enum { SIZE = 1 << 16, NRAW = 8, NIN = NRAW * (NRAW + 1) / 2, NOUT = 4 };
+enum { STEPS = 20000 };
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+int main(void) {
+  void *tapebuf = tapecreate(SIZE);
+  if (!tapebuf)
+    return 1;
+  tapeseed(42);
+
+  len_t llens[] = {NIN, 32, 32, NOUT};
+  net_t *net = netcreate(len(llens), llens);
+  if (!net)
+    return 1;
+
+  idx_t zero = vconst(0);
+  idx_t mark = tapemark();
+
+  idx_t raw[NRAW];
+  idx_t features[NIN];
+  idx_t rdata[NOUT];
+  vec_t input, result;
+  vecinit(&input, NIN, features);
+  vecinit(&result, NOUT, rdata);
+
+  bool counting = perfopen() == 0;
+  value_t sum = 0;
+  double start = now();
+  for (int step = 0; step < STEPS; step++) {
+    tapereset(mark);
+    for (int i = 0; i < NRAW; i++) {
+      raw[i] = vfrom(sin(step * 0.1 + i));
+    }
+
+    // Quadratic features: every product of two raw inputs
+    len_t k = 0;
+    for (int i = 0; i < NRAW; i++) {
+      for (int j = i; j < NRAW; j++) {
+        features[k++] = vmul(raw[i], raw[j]);
+      }
+    }
+
+    netfwd(net, &input, &result);
+
+    idx_t loss = zero;
+    for (int o = 0; o < NOUT; o++) {
+      idx_t diff = vsub(result.at[o], vtanh(raw[o]));
+      loss = vadd(loss, vmul(diff, diff));
+    }
+    sum += tapeval(loss);
+
+    tapezerograd();
+    tapebackprop(loss);
+    netgdstep(net, 0.01);
+  }
+  double elapsed = now() - start;
+
+  printf("%d steps in %.3fs (%.1fus per step), mean loss %f\n", STEPS,
+         elapsed, elapsed * 1e6 / STEPS, sum / STEPS);
+  if (counting) {
+    perfreport(stdout, STEPS);
+    perfclose();
+  }
+
+  GRADINO_FREE(net);
+  GRADINO_FREE(tapebuf);
+  return 0;
+}
@@ -0,0 +1,93 @@
+// Second-order training on a small, full-batch problem.
+//
+// The seven-segment digits of examples/03_inference are learned twice from
+// the same initial parameters: with netfit, one stochastic gradient step per
+// sample, and with netlbfgs on the whole batch.
+#define _POSIX_C_SOURCE 200809L
+#include "../gradino.h"
+#include <time.h>
+
+#define len(Arr) sizeof(Arr) / sizeof(Arr[0])
+
+enum { NSAMPLES = 14, NIN = 7, NOUT = 11, EPOCHS = 10000, ITERS = 100 };
+
+// Segments of the digits, then of shapes that are not digits
+static const value_t SEGMENTS[NSAMPLES][NIN] = {
+    {1, 1, 1, 1, 1, 1, -1},    {-1, 1, 1, -1, -1, -1, -1},
+    {1, 1, -1, 1, 1, -1, 1},   {1, 1, 1, 1, -1, -1, 1},
+    {-1, 1, 1, -1, -1, 1, 1},  {1, -1, 1, 1, -1, 1, 1},
+    {1, -1, 1, 1, 1, 1, 1},    {1, 1, 1, -1, -1, -1, -1},
+    {1, 1, 1, 1, 1, 1, 1},     {1, 1, 1, 1, -1, 1, 1},
+    {1, -1, -1, -1, 1, -1, 1}, {-1, -1, 1, -1, 1, -1, -1},
+    {-1, 1, -1, 1, -1, 1, -1}, {1, -1, 1, -1, 1, -1, -1},
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static len_t iterations;
+static bool count(len_t iter, value_t loss, void *ctx) {
+  (void)loss, (void)ctx;
+  iterations = iter + 1;
+  return true;
+}
+
+int main(void) {
+  void *tapebuf = tapecreate(1 << 12);
+  if (!tapebuf)
+    return 1;
+
+  static value_t targets[NSAMPLES][NOUT];
+  for (int s = 0; s < NSAMPLES; s++) {
+    for (int k = 0; k < NOUT; k++) {
+      targets[s][k] = k == (s < 10 ? s : 10) ? 1.0 : -1.0;
+    }
+  }
+
+  // Both networks start from the same parameters
+  len_t llens[] = {NIN, 8, NOUT};
+  tapeseed(7);
+  net_t *sgd = netcreate(len(llens), llens);
+  tapeseed(7);
+  net_t *lbfgs = netcreate(len(llens), llens);
+  if (!sgd || !lbfgs)
+    return 1;
+
+  fit_t fit = {0};
+  fit.inputs = &SEGMENTS[0][0];
+  fit.targets = &targets[0][0];
+  fit.nsamples = NSAMPLES;
+  fit.epochs = EPOCHS;
+  fit.batch = 1;
+  fit.rate = 0.005;
+  fit.loss = LOSS_SQUARED;
+  fit.onepoch = count;
+
+  char *buf = malloc(fitsize(sgd, &fit));
+  if (!buf)
+    return 1;
+  double start = now();
+  value_t loss = netfit(sgd, &fit, fitsize(sgd, &fit), buf);
+  printf("sgd:    %5lu epochs     in %.3fs, loss %g\n", iterations,
+         now() - start, loss);
+  free(buf);
+
+  fit.epochs = ITERS;
+  len_t history = 8;
+  buf = malloc(lbfgssize(lbfgs, history));
+  if (!buf)
+    return 1;
+  start = now();
+  loss = netlbfgs(lbfgs, &fit, history, lbfgssize(lbfgs, history), buf);
+  printf("l-bfgs: %5lu iterations in %.3fs, loss %g\n", iterations,
+         now() - start, loss);
+  free(buf);
+
+  GRADINO_FREE(lbfgs);
+  GRADINO_FREE(sgd);
+  GRADINO_FREE(tapebuf);
+  return 0;
+}
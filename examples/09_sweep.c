@@ -0,0 +1,261 @@
+// Parallel hyperparameter sweep over the tic-tac-toe network.
+//
+// The positions of examples/04_tictactoe are generated once, into memory
+// shared with every worker. Workers are forked processes, each pinned to a
+// core with its own tape, which take configurations from a shared counter
+// until none is left. Final loss, accuracy and wall time of every
+// configuration are collected in a shared results table.
+//
+//   ./examples/09_sweep [workers]
+//
+// Without an argument there is one worker per online core.
+#define _GNU_SOURCE
+#include "../gradino.h"
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#define len(Arr) sizeof(Arr) / sizeof(Arr[0])
+
+enum { CELLS = 9, MAX_SAMPLES = 1024 };
+
+static const double RATES[] = {0.001, 0.005, 0.02};
+static const len_t WIDTHS[] = {9, 27, 54};
+static const len_t EPOCHS[] = {20, 80};
+enum {
+  NRATES = len(RATES),
+  NWIDTHS = len(WIDTHS),
+  NEPOCHS = len(EPOCHS),
+  NCONFIGS = NRATES * NWIDTHS * NEPOCHS,
+};
+
+static const int WIN_LINES[8][3] = {
+    {0, 1, 2}, {3, 4, 5}, {6, 7, 8}, {0, 3, 6},
+    {1, 4, 7}, {2, 5, 8}, {0, 4, 8}, {2, 4, 6},
+};
+
+static int winner(const int *b) {
+  for (int i = 0; i < 8; i++) {
+    int s = b[WIN_LINES[i][0]] + b[WIN_LINES[i][1]] + b[WIN_LINES[i][2]];
+    if (s == 3)
+      return 1;
+    if (s == -3)
+      return -1;
+  }
+  return 0;
+}
+
+static int full(const int *b) {
+  for (int i = 0; i < CELLS; i++)
+    if (b[i] == 0)
+      return 0;
+  return 1;
+}
+
+static int minimax(int *b, int player, int *best) {
+  int w = winner(b);
+  if (w != 0)
+    return w * 10;
+  if (full(b))
+    return 0;
+
+  int best_score = player > 0 ? -100 : 100;
+  *best = -1;
+  for (int i = 0; i < CELLS; i++) {
+    if (b[i] != 0)
+      continue;
+    b[i] = player;
+    int dummy;
+    int score = minimax(b, -player, &dummy);
+    b[i] = 0;
+    if (player > 0 ? score > best_score : score < best_score) {
+      best_score = score;
+      *best = i;
+    }
+  }
+  return best_score;
+}
+
+// Dataset and results, shared by every process
+typedef struct {
+  value_t inputs[MAX_SAMPLES][CELLS];
+  value_t targets[MAX_SAMPLES][CELLS];
+  int moves[MAX_SAMPLES];
+  len_t nsamples;
+  bool seen[19683]; // 3^9 board encodings
+  len_t next;       // next configuration to run
+  struct {
+    double rate;
+    len_t width;
+    len_t epochs;
+    value_t loss;
+    double accuracy;
+    double seconds;
+    bool done;
+  } results[NCONFIGS];
+} shared_t;
+
+static void generate(shared_t *sh, int *board, int player) {
+  if (winner(board) || full(board) || sh->nsamples >= MAX_SAMPLES)
+    return;
+
+  if (player > 0) {
+    int h = 0;
+    for (int i = 0; i < CELLS; i++)
+      h = h * 3 + (board[i] + 1);
+    if (!sh->seen[h]) {
+      sh->seen[h] = true;
+      int best;
+      minimax(board, player, &best);
+      for (int i = 0; i < CELLS; i++) {
+        sh->inputs[sh->nsamples][i] = (value_t)board[i];
+        sh->targets[sh->nsamples][i] = i == best ? 1.0 : -1.0;
+      }
+      sh->moves[sh->nsamples++] = best;
+    }
+  }
+
+  for (int i = 0; i < CELLS; i++) {
+    if (board[i] != 0)
+      continue;
+    board[i] = player;
+    generate(sh, board, -player);
+    board[i] = 0;
+  }
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void run(shared_t *sh, len_t config) {
+  len_t r = config / (NWIDTHS * NEPOCHS);
+  len_t w = config / NEPOCHS % NWIDTHS;
+  len_t e = config % NEPOCHS;
+
+  len_t llens[] = {CELLS, WIDTHS[w], CELLS};
+  arena_t arena = {0};
+  arena.nlens = len(llens);
+  arena.llens = llens;
+  arena.fit = sh->nsamples;
+  arena.infer = sh->nsamples;
+  void *buf = arenacreate(&arena);
+  if (!buf)
+    return;
+  tapeseed(config + 1);
+  netrand(&arena.net, INIT_XAVIER);
+
+  fit_t fit = {0};
+  fit.inputs = &sh->inputs[0][0];
+  fit.targets = &sh->targets[0][0];
+  fit.nsamples = sh->nsamples;
+  fit.epochs = EPOCHS[e];
+  fit.batch = 1;
+  fit.rate = RATES[r];
+  fit.loss = LOSS_SQUARED;
+
+  double start = now();
+  value_t loss = netfit(&arena.net, &fit, arena.nfitbuf, arena.fitbuf);
+  double seconds = now() - start;
+
+  // Accuracy: how often the best scored cell is the minimax move
+  static value_t outputs[MAX_SAMPLES][CELLS];
+  netinfer(&arena.net, &sh->inputs[0][0], sh->nsamples, &outputs[0][0],
+           arena.ninferbuf, arena.inferbuf);
+  len_t hits = 0;
+  for (len_t s = 0; s < sh->nsamples; s++) {
+    int best = 0;
+    for (int i = 1; i < CELLS; i++) {
+      if (outputs[s][i] > outputs[s][best])
+        best = i;
+    }
+    hits += best == sh->moves[s];
+  }
+
+  sh->results[config].rate = RATES[r];
+  sh->results[config].width = WIDTHS[w];
+  sh->results[config].epochs = EPOCHS[e];
+  sh->results[config].loss = loss;
+  sh->results[config].accuracy = (double)hits / (double)sh->nsamples;
+  sh->results[config].seconds = seconds;
+  sh->results[config].done = true;
+  GRADINO_FREE(buf);
+}
+
+static void worker(shared_t *sh, int core) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET((size_t)core, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+#else
+  (void)core;
+#endif
+  for (;;) {
+    len_t config = __atomic_fetch_add(&sh->next, 1, __ATOMIC_RELAXED);
+    if (config >= NCONFIGS)
+      return;
+    run(sh, config);
+  }
+}
+
+int main(int argc, char **argv) {
+  int ncores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int nworkers = argc > 1 ? atoi(argv[1]) : ncores;
+  if (nworkers < 1)
+    nworkers = 1;
+  if (nworkers > NCONFIGS)
+    nworkers = NCONFIGS;
+
+  shared_t *sh = mmap(NULL, sizeof(shared_t), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (sh == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  int board[CELLS] = {0};
+  generate(sh, board, 1);
+  printf("%lu positions, %d configurations on %d workers\n", sh->nsamples,
+         NCONFIGS, nworkers);
+
+  double start = now();
+  for (int i = 0; i < nworkers; i++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      break;
+    }
+    if (pid == 0) {
+      worker(sh, i % ncores);
+      _exit(0);
+    }
+  }
+  while (wait(NULL) > 0) {
+  }
+  double elapsed = now() - start;
+
+  printf("\n  rate  width  epochs      loss  accuracy   time\n");
+  double serial = 0;
+  for (int i = 0; i < NCONFIGS; i++) {
+    if (!sh->results[i].done) {
+      printf("configuration %d failed\n", i);
+      continue;
+    }
+    printf("%6.3f  %5lu  %6lu  %8.4f  %7.1f%%  %5.2fs\n", sh->results[i].rate,
+           sh->results[i].width, sh->results[i].epochs, sh->results[i].loss,
+           sh->results[i].accuracy * 100, sh->results[i].seconds);
+    serial += sh->results[i].seconds;
+  }
+  printf("\n%.2fs wall time for %.2fs of training\n", elapsed, serial);
+
+  munmap(sh, sizeof(shared_t));
+  return 0;
+}
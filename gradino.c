@@ -1,4 +1,6 @@
+#define GRADINO_SOURCE
 #include "gradino.h"
+#include <float.h>
 #include <math.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -7,7 +9,13 @@
 #include <time.h>
 #include <stdint.h>
 
-static tape_t TAPE;
+// The tape and its primitives are defined in gradino.h, next to the hot path
+#ifdef GRADINO_INLINE
+GRADINO_TLS tape_t gradino_tape;
+#endif
+#define TAPE gradino_tape
+#define tval gradino_tval
+#define tput gradino_tput
 
 ///
 /// UTILS
@@ -18,6 +26,7 @@ static tape_t TAPE;
 #define panicif(Assertion, Fmt) ((void)0)
 #else
 #include <execinfo.h>
+#include <stdarg.h>
 
 static void stacktrace(FILE *out) {
   void *addrs[128];
@@ -34,31 +43,28 @@ static void stacktrace(FILE *out) {
   }
 }
 
+void gradino_panic(const char *file, int line, const char *fmt, ...) {
+  fprintf(stderr, "%s:%i panic: ", file, line);
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputs("\n", stderr);
+  stacktrace(stderr);
+  exit(1);
+}
+
 // Abort when a condition is met. Prints a formatted message and a stack trace.
 #define paniciff(Assertion, Fmt, ...)                                          \
   if (Assertion) {                                                             \
-    char buf[256];                                                             \
-    snprintf(buf, sizeof(buf), "%s:%i panic: ", __FILE__, __LINE__);           \
-    fputs(buf, stderr);                                                        \
-    snprintf(buf, sizeof(buf), Fmt, __VA_ARGS__);                              \
-    fputs(buf, stderr);                                                        \
-    fputs("\n", stderr);                                                       \
-    stacktrace(stderr);                                                        \
-    exit(1);                                                                   \
+    gradino_panic(__FILE__, __LINE__, Fmt, __VA_ARGS__);                       \
   }
 
 // Abort when a condition is met. Prints a static message and a stack trace.
 // Use paniciff for the formatted version
 #define panicif(Assertion, Fmt)                                                \
   if (Assertion) {                                                             \
-    char buf[256];                                                             \
-    snprintf(buf, sizeof(buf), "%s:%i panic: ", __FILE__, __LINE__);           \
-    fputs(buf, stderr);                                                        \
-    snprintf(buf, sizeof(buf), Fmt);                                           \
-    fputs(buf, stderr);                                                        \
-    fputs("\n", stderr);                                                       \
-    stacktrace(stderr);                                                        \
-    exit(1);                                                                   \
+    gradino_panic(__FILE__, __LINE__, Fmt);                                    \
   }
 #endif
 
@@ -74,6 +80,184 @@ static void stacktrace(FILE *out) {
 
 static inline len_t max(len_t a, len_t b) { return a > b ? a : b; }
 
+///
+/// PERF
+/// ===
+
+static const char *PERF_PHASES[PERF_NPHASES] = {"netfwd", "tapebackprop",
+                                                 "tapezerograd", "netgdstep"};
+
+#if defined(GRADINO_PERF) && defined(GRADINO_POSIX) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Counters of a thread. The events that could be opened form one group, read
+// at once through the leader; slots maps every event to its position in a
+// group read, or is -1 when the event is unavailable.
+typedef struct {
+  int fds[PERF_NEVENTS];
+  int slots[PERF_NEVENTS];
+  int nopen;
+  bool enabled;
+  uint64_t start[PERF_NPHASES][PERF_NEVENTS];
+  perfstats_t phases[PERF_NPHASES];
+} perf_t;
+
+static GRADINO_TLS perf_t perf;
+
+static bool perfsample(uint64_t *values) {
+  struct {
+    uint64_t nr;
+    uint64_t values[PERF_NEVENTS];
+  } group;
+  if (read(perf.fds[0], &group, sizeof(group)) <= 0)
+    return false;
+  for (int e = 0; e < PERF_NEVENTS; e++) {
+    values[e] = perf.slots[e] >= 0 ? group.values[perf.slots[e]] : 0;
+  }
+  return true;
+}
+
+static void perfbegin(perfphase_t phase) {
+  if (perf.enabled && !perfsample(perf.start[phase]))
+    perf.enabled = false;
+}
+
+static void perfend(perfphase_t phase) {
+  uint64_t now[PERF_NEVENTS];
+  if (!perf.enabled || !perfsample(now))
+    return;
+  perfstats_t *p = &perf.phases[phase];
+  p->calls++;
+  for (int e = 0; e < PERF_NEVENTS; e++) {
+    p->counts[e] += now[e] - perf.start[phase][e];
+  }
+}
+
+#define PERF_BEGIN(Phase) perfbegin(Phase)
+#define PERF_END(Phase) perfend(Phase)
+
+int perfopen(void) {
+  static const uint64_t configs[PERF_NEVENTS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+  perfclose();
+  int leader = -1;
+  for (int e = 0; e < PERF_NEVENTS; e++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[e];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    perf.slots[e] = -1;
+    if (fd < 0)
+      continue;
+    if (leader < 0)
+      leader = fd;
+    perf.slots[e] = perf.nopen;
+    perf.fds[perf.nopen++] = fd;
+  }
+  if (perf.nopen == 0)
+    return -1;
+
+  perfreset();
+  perf.enabled = true;
+  return 0;
+}
+
+void perfenable(bool on) { perf.enabled = on && perf.nopen > 0; }
+
+void perfreset(void) { memset(perf.phases, 0, sizeof(perf.phases)); }
+
+bool perfhas(perfevent_t event) {
+  paniciff((int)event < 0 || event >= PERF_NEVENTS, "invalid event %d",
+           (int)event);
+  return perf.nopen > 0 && perf.slots[event] >= 0;
+}
+
+perfstats_t perfstats(perfphase_t phase) {
+  paniciff((int)phase < 0 || phase >= PERF_NPHASES, "invalid phase %d",
+           (int)phase);
+  return perf.phases[phase];
+}
+
+void perfclose(void) {
+  for (int i = 0; i < perf.nopen; i++) {
+    close(perf.fds[i]);
+  }
+  perf.nopen = 0;
+  perf.enabled = false;
+}
+#else
+#define PERF_BEGIN(Phase) ((void)0)
+#define PERF_END(Phase) ((void)0)
+
+int perfopen(void) { return -1; }
+void perfenable(bool on) { (void)on; }
+void perfreset(void) {}
+bool perfhas(perfevent_t event) {
+  (void)event;
+  return false;
+}
+perfstats_t perfstats(perfphase_t phase) {
+  (void)phase;
+  return (perfstats_t){0};
+}
+void perfclose(void) {}
+#endif
+
+void perfreport(FILE *out, uint64_t samples) {
+  panicif(!out, "must provide output");
+  static const char *events[PERF_NEVENTS] = {"cycles", "instructions",
+                                             "cache-misses", "branch-misses"};
+  bool any = false;
+  for (int e = 0; e < PERF_NEVENTS; e++) {
+    any = any || perfhas((perfevent_t)e);
+  }
+  if (!any) {
+    fputs("performance counters unavailable\n", out);
+    return;
+  }
+
+  fprintf(out, "%-14s %10s", "phase", "calls");
+  for (int e = 0; e < PERF_NEVENTS; e++) {
+    fprintf(out, " %14s", events[e]);
+  }
+  fprintf(out, " %6s\n", "ipc");
+
+  for (int p = 0; p < PERF_NPHASES; p++) {
+    perfstats_t st = perfstats((perfphase_t)p);
+    fprintf(out, "%-14s %10llu", PERF_PHASES[p], (unsigned long long)st.calls);
+    for (int e = 0; e < PERF_NEVENTS; e++) {
+      if (!perfhas((perfevent_t)e)) {
+        fprintf(out, " %14s", "n/a");
+        continue;
+      }
+      // Per sample when the number of samples is known
+      double count = (double)st.counts[e];
+      fprintf(out, " %14.1f", samples > 0 ? count / (double)samples : count);
+    }
+    if (perfhas(PERF_CYCLES) && perfhas(PERF_INSTRUCTIONS) &&
+        st.counts[PERF_CYCLES] > 0) {
+      fprintf(out, " %6.2f",
+              (double)st.counts[PERF_INSTRUCTIONS] /
+                  (double)st.counts[PERF_CYCLES]);
+    }
+    fputs("\n", out);
+  }
+  if (samples > 0)
+    fprintf(out, "(events per sample, over %llu samples)\n",
+            (unsigned long long)samples);
+}
+
 ///
 /// TAPE
 /// ===
@@ -108,11 +292,13 @@ void tapeinit(len_t n, len_t nbuf, char *buffer) {
 
   TAPE.ops = ptr;
 
+  TAPE.shared = NULL;
+  TAPE.base = 0;
   TAPE.len = 0;
   TAPE.cap = n;
+  TAPE.nconsts = 0;
 
-  // seed the rng
-  srand((unsigned)time(NULL));
+  tapeseed((uint64_t)time(NULL));
 }
 
 void *tapecreate(len_t n) {
@@ -126,136 +312,607 @@ void *tapecreate(len_t n) {
 
 #undef MAX_ALIGN
 
-// The only way to add to the tape is through pushing. This ensures that the
-// tape will always be topologically sorted, and backpropagation will work.
-static inline idx_t tpushval(value_t val) {
-  paniciff(TAPE.len >= TAPE.cap, "buffer full (cap=%lu)", TAPE.cap);
-  idx_t idx = TAPE.len;
-  TAPE.values[idx] = val;
-  TAPE.len++;
-  return idx;
+void tapeseed(uint64_t seed) {
+  // Expand the seed with splitmix64, as xoshiro must not start from all zeros
+  for (int i = 0; i < 4; i++) {
+    uint64_t z = (seed += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    TAPE.rng[i] = z ^ (z >> 31);
+  }
 }
 
-value_t tapeval(idx_t idx) {
-  paniciff(idx >= TAPE.len, "index %lu out of bounds (len=%lu, cap=%lu)", idx,
-           TAPE.len, TAPE.cap);
-  return TAPE.values[idx];
+static inline uint64_t rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
 }
 
-value_t tapegrad(idx_t idx) {
-  paniciff(idx >= TAPE.len, "index %lu out of bounds (len=%lu, cap=%lu)", idx,
-           TAPE.len, TAPE.cap);
-  return TAPE.grads[idx];
+// Next number from the tape generator (xoshiro256**). Being part of the tape,
+// it is as thread-safe as the tape itself.
+static inline uint64_t trand(void) {
+  uint64_t *s = TAPE.rng;
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
 }
 
-static op_t tapeop(idx_t idx) {
-  paniciff(idx >= TAPE.len, "index %lu out of bounds (len=%lu, cap=%lu)", idx,
-           TAPE.len, TAPE.cap);
-  return TAPE.ops[idx];
+// Check that n more records fit. Code recording many records at once, like a
+// layer, reserves them upfront and then pushes them with tput.
+static inline void treserve(len_t n) {
+  paniciff(TAPE.len - TAPE.base + n > TAPE.cap,
+           "buffer full (cap=%lu, len=%lu, reserving %lu)", TAPE.cap,
+           TAPE.len - TAPE.base, n);
+  (void)n; // silence unused warning for release builds
+}
+
+// The only way to add to the tape is through pushing. This ensures that the
+// tape will always be topologically sorted, and backpropagation will work.
+static inline idx_t tpush(value_t val, optype_t type, idx_t in0, idx_t in1) {
+  treserve(1);
+  return tput(val, type, in0, in1);
 }
 
-idx_t tapemark(void) { return TAPE.len; }
+static op_t tapeop(idx_t idx) {
+  paniciff(idx >= TAPE.len || idx < TAPE.base,
+           "index %lu out of bounds (base=%lu, len=%lu, cap=%lu)", idx,
+           TAPE.base, TAPE.len, TAPE.cap);
+  return TAPE.ops[idx - TAPE.base];
+}
 
 void tapereset(idx_t mark) {
-  paniciff(mark >= TAPE.cap, "expected mark less than %lu, got %lu", TAPE.cap,
-           mark);
+  paniciff(mark < TAPE.base || mark - TAPE.base >= TAPE.cap,
+           "expected mark in [%lu, %lu), got %lu", TAPE.base,
+           TAPE.base + TAPE.cap, mark);
   TAPE.len = mark;
+  while (TAPE.nconsts > 0 && TAPE.consts[TAPE.nconsts - 1].idx >= mark) {
+    TAPE.nconsts--;
+  }
 }
 
 void tapezerograd(void) {
-  for (idx_t i = 0; i < TAPE.len; i++) {
+  PERF_BEGIN(PERF_ZEROGRAD);
+  for (idx_t i = 0; i < TAPE.len - TAPE.base; i++) {
     TAPE.grads[i] = 0;
   }
+  PERF_END(PERF_ZEROGRAD);
+}
+
+// Backward kernels. Each one processes a run of records of its type, from
+// to - 1 down to from. Gradients are only tracked for the tape's own records;
+// with no segment attached base is zero and these offsets vanish.
+
+static void bconst(idx_t from, idx_t to) { (void)from, (void)to; }
+
+static void badd(idx_t from, idx_t to) {
+  idx_t base = TAPE.base;
+  const op_t *ops = TAPE.ops;
+  value_t *grads = TAPE.grads;
+  for (idx_t i = to; i-- > from;) {
+    const op_t *op = &ops[i - base];
+    value_t grad = grads[i - base];
+    if (op->input[0] >= base)
+      grads[op->input[0] - base] += grad;
+    if (op->input[1] >= base)
+      grads[op->input[1] - base] += grad;
+  }
+}
+
+static void bsub(idx_t from, idx_t to) {
+  idx_t base = TAPE.base;
+  const op_t *ops = TAPE.ops;
+  value_t *grads = TAPE.grads;
+  for (idx_t i = to; i-- > from;) {
+    const op_t *op = &ops[i - base];
+    value_t grad = grads[i - base];
+    if (op->input[0] >= base)
+      grads[op->input[0] - base] += grad;
+    if (op->input[1] >= base)
+      grads[op->input[1] - base] -= grad;
+  }
+}
+
+static void bmul(idx_t from, idx_t to) {
+  idx_t base = TAPE.base;
+  const op_t *ops = TAPE.ops;
+  value_t *grads = TAPE.grads;
+  for (idx_t i = to; i-- > from;) {
+    const op_t *op = &ops[i - base];
+    value_t grad = grads[i - base];
+    idx_t in0 = op->input[0];
+    idx_t in1 = op->input[1];
+    if (in0 >= base)
+      grads[in0 - base] += grad * tval(in1);
+    if (in1 >= base)
+      grads[in1 - base] += grad * tval(in0);
+  }
+}
+
+static void btanh(idx_t from, idx_t to) {
+  idx_t base = TAPE.base;
+  const op_t *ops = TAPE.ops;
+  const value_t *values = TAPE.values;
+  value_t *grads = TAPE.grads;
+  for (idx_t i = to; i-- > from;) {
+    const op_t *op = &ops[i - base];
+    value_t out = values[i - base];
+    if (op->input[0] >= base)
+      grads[op->input[0] - base] += (1.0 - out * out) * grads[i - base];
+  }
 }
 
+static void (*const BACKWARD[])(idx_t from, idx_t to) = {
+    [OP_CONST] = bconst, [OP_ADD] = badd,   [OP_SUB] = bsub,
+    [OP_MUL] = bmul,     [OP_TANH] = btanh,
+};
+
 void tapebackprop(idx_t start) {
-  TAPE.grads[start] = 1.0;
-  for (idx_t i = start + 1; i-- > 0;) {
-    op_t op = tapeop(i);
-    idx_t in0 = op.input[0];
-    idx_t in1 = op.input[1];
-    idx_t out = op.output;
+  paniciff(start < TAPE.base || start >= TAPE.len,
+           "index %lu out of bounds (base=%lu, len=%lu, cap=%lu)", start,
+           TAPE.base, TAPE.len, TAPE.cap);
+
+  PERF_BEGIN(PERF_BACKPROP);
+  // Operations of the same type tend to be recorded in runs (the products of
+  // a perceptron, then its sums), so the records are dispatched by run rather
+  // than one at a time
+  idx_t base = TAPE.base;
+  const op_t *ops = TAPE.ops;
+  TAPE.grads[start - base] = 1.0;
+  for (idx_t to = start + 1; to > base;) {
+    optype_t type = ops[to - 1 - base].type;
+    paniciff((size_t)type >= sizeof(BACKWARD) / sizeof(BACKWARD[0]),
+             "invalid op type %d at %lu", (int)type, to - 1);
+    idx_t from = to - 1;
+    while (from > base && ops[from - 1 - base].type == type)
+      from--;
+    BACKWARD[type](from, to);
+    to = from;
+  }
+  PERF_END(PERF_BACKPROP);
+}
+
+len_t tapecompact(idx_t from, idx_t root, idx_t *remap) {
+  paniciff(root >= TAPE.len, "index %lu out of bounds (len=%lu, cap=%lu)", root,
+           TAPE.len, TAPE.cap);
+  paniciff(from > root, "expected from not greater than %lu, got %lu", root,
+           from);
+  paniciff(from < TAPE.base, "expected from not less than %lu, got %lu",
+           TAPE.base, from);
+  panicif(!remap, "must provide remap");
 
+  // Mark: any index other than IDX_NONE flags a record reachable from root
+  for (idx_t i = 0; i < TAPE.len; i++) {
+    remap[i] = i < from ? i : IDX_NONE;
+  }
+  remap[root] = root;
+  for (idx_t i = root + 1; i-- > from;) {
+    if (remap[i] == IDX_NONE)
+      continue;
+
+    op_t op = tapeop(i);
     switch (op.type) {
     case OP_CONST:
       break;
-    case OP_ADD:
-      TAPE.grads[in0] += TAPE.grads[out];
-      TAPE.grads[in1] += TAPE.grads[out];
+    case OP_TANH:
+      remap[op.input[0]] = op.input[0];
       break;
+    case OP_ADD:
+    case OP_SUB:
     case OP_MUL:
-      TAPE.grads[in0] += TAPE.grads[out] * TAPE.values[in1];
-      TAPE.grads[in1] += TAPE.grads[out] * TAPE.values[in0];
+      remap[op.input[0]] = op.input[0];
+      remap[op.input[1]] = op.input[1];
       break;
+    default:
+      unreacheable();
+      break;
+    }
+  }
+
+  // Sweep: inputs always precede their outputs, so they are already
+  // renumbered by the time a survivor is moved
+  idx_t next = from;
+  for (idx_t i = from; i < TAPE.len; i++) {
+    if (remap[i] == IDX_NONE)
+      continue;
+
+    remap[i] = next;
+    op_t op = tapeop(i);
+    switch (op.type) {
+    case OP_CONST:
     case OP_TANH:
-      TAPE.grads[in0] +=
-          (1.0 - TAPE.values[out] * TAPE.values[out]) * TAPE.grads[out];
+      op.input[0] = remap[op.input[0]];
       break;
+    case OP_ADD:
     case OP_SUB:
-      TAPE.grads[in0] += TAPE.grads[out];
-      TAPE.grads[in1] -= TAPE.grads[out];
+    case OP_MUL:
+      op.input[0] = remap[op.input[0]];
+      op.input[1] = remap[op.input[1]];
       break;
     default:
       unreacheable();
       break;
     }
+    op.output = next;
+
+    TAPE.ops[next - TAPE.base] = op;
+    TAPE.values[next - TAPE.base] = TAPE.values[i - TAPE.base];
+    TAPE.grads[next - TAPE.base] = TAPE.grads[i - TAPE.base];
+    next++;
+  }
+
+  // Interned constants keep their relative order, as the remap is monotonic
+  len_t nconsts = 0;
+  for (len_t i = 0; i < TAPE.nconsts; i++) {
+    idx_t idx = remap[TAPE.consts[i].idx];
+    if (idx == IDX_NONE)
+      continue;
+    TAPE.consts[nconsts].value = TAPE.consts[i].value;
+    TAPE.consts[nconsts].idx = idx;
+    nconsts++;
+  }
+  TAPE.nconsts = nconsts;
+
+  len_t removed = TAPE.len - next;
+  TAPE.len = next;
+  return removed;
+}
+
+void tapeattach(const seg_t *seg) {
+  panicif(!seg, "segment cannot be null");
+  panicif(TAPE.len != TAPE.base, "tape must be empty to attach a segment");
+
+  TAPE.shared = seg->values;
+  TAPE.base = seg->len;
+  TAPE.len = seg->len;
+  TAPE.nconsts = seg->nconsts;
+  for (len_t i = 0; i < seg->nconsts; i++) {
+    TAPE.consts[i] = seg->consts[i];
   }
 }
 
 ///
-/// VALUE
+/// SCHEDULE
 /// ===
 
-static value_t vrand(void) {
-  return (double)((double)rand() / RAND_MAX) * 2.0 - 1.0;
+// Levels narrower than this are processed by a single thread, as splitting
+// them costs more in synchronization than it saves in work
+enum { SCHED_GRAIN = 256 };
+
+// Number of inputs read by an operation
+static len_t opninputs(optype_t type) {
+  switch (type) {
+  case OP_CONST:
+    return 0;
+  case OP_TANH:
+    return 1;
+  case OP_ADD:
+  case OP_SUB:
+  case OP_MUL:
+    return 2;
+  default:
+    unreacheable();
+    return 0;
+  }
 }
 
-idx_t vfrom(value_t value) {
-  idx_t pushed = tpushval(value);
-  TAPE.ops[pushed].type = OP_CONST;
-  TAPE.ops[pushed].input[0] = pushed;
-  TAPE.ops[pushed].output = pushed;
-  TAPE.grads[pushed] = 0;
-  return pushed;
+size_t schedsize(idx_t root) {
+  len_t n = root + 1;
+  // levels and offsets, order, users, and two temporaries per record
+  return sizeof(len_t) + sizeof(len_t) * 2 * (n + 1) + sizeof(idx_t) * n +
+         sizeof(idx_t) * 2 * n + sizeof(len_t) * 2 * n;
 }
 
-idx_t vadd(idx_t a, idx_t b) {
-  idx_t pushed = tpushval(tapeval(a) + tapeval(b));
-  TAPE.ops[pushed].type = OP_ADD;
-  TAPE.ops[pushed].input[0] = a;
-  TAPE.ops[pushed].input[1] = b;
-  TAPE.ops[pushed].output = pushed;
-  TAPE.grads[pushed] = 0;
-  return pushed;
+void schedinit(sched_t *s, idx_t root, len_t nbuf, char *buffer) {
+  panicif(!s, "schedule cannot be null");
+  panicif(!buffer, "must provide buffer");
+  panicif(TAPE.base > 0, "schedules need a tape without segment");
+  paniciff(root >= TAPE.len, "index %lu out of bounds (len=%lu, cap=%lu)", root,
+           TAPE.len, TAPE.cap);
+  paniciff(nbuf < schedsize(root),
+           "buffer too small; expected at least %lu, got %lu", schedsize(root),
+           nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  uintptr_t addr = (uintptr_t)buffer;
+  uintptr_t aligned = (addr + sizeof(len_t) - 1) & ~(sizeof(len_t) - 1);
+
+  len_t n = root + 1;
+  void *ptr = (void *)aligned;
+  s->levels = ptr;
+  ptr = (len_t *)ptr + n + 1;
+  s->offsets = ptr;
+  ptr = (len_t *)ptr + n + 1;
+  s->order = ptr;
+  ptr = (idx_t *)ptr + n;
+  s->users = ptr;
+  ptr = (idx_t *)ptr + 2 * n;
+  len_t *level = ptr;
+  ptr = (len_t *)ptr + n;
+  len_t *nusers = ptr;
+  s->root = root;
+
+  // Level of each record, as one more than the deepest of its users.
+  // IDX_NONE flags the records that do not reach the root. Users always come
+  // after their inputs on the tape, so a single reverse sweep is enough.
+  for (idx_t i = 0; i < n; i++) {
+    level[i] = IDX_NONE;
+    nusers[i] = 0;
+  }
+  level[root] = 0;
+  len_t nlevels = 1;
+  for (idx_t i = n; i-- > 0;) {
+    if (level[i] == IDX_NONE)
+      continue;
+
+    op_t op = TAPE.ops[i];
+    for (len_t k = 0; k < opninputs(op.type); k++) {
+      idx_t in = op.input[k];
+      if (level[in] == IDX_NONE || level[in] < level[i] + 1)
+        level[in] = level[i] + 1;
+      nlevels = max(nlevels, level[in] + 1);
+      nusers[in]++;
+    }
+  }
+
+  // Records sorted by level with a counting sort, which keeps them in tape
+  // order within a level
+  for (len_t l = 0; l <= nlevels; l++) {
+    s->levels[l] = 0;
+  }
+  for (idx_t i = 0; i < n; i++) {
+    if (level[i] != IDX_NONE)
+      s->levels[level[i] + 1]++;
+  }
+  for (len_t l = 0; l < nlevels; l++) {
+    s->levels[l + 1] += s->levels[l];
+  }
+  for (idx_t i = 0; i < n; i++) {
+    if (level[i] != IDX_NONE)
+      s->order[s->levels[level[i]]++] = i;
+  }
+  for (len_t l = nlevels; l-- > 1;) {
+    s->levels[l] = s->levels[l - 1];
+  }
+  s->levels[0] = 0;
+  s->nlevels = nlevels;
+
+  // Users in compressed rows following the order, so that a level reads its
+  // users sequentially. From now on level holds the position in order.
+  len_t nsched = s->levels[nlevels];
+  s->offsets[0] = 0;
+  for (len_t k = 0; k < nsched; k++) {
+    idx_t i = s->order[k];
+    level[i] = k;
+    s->offsets[k + 1] = s->offsets[k] + nusers[i];
+  }
+  for (idx_t i = n; i-- > 0;) {
+    if (level[i] == IDX_NONE)
+      continue;
+
+    op_t op = TAPE.ops[i];
+    for (len_t k = 0; k < opninputs(op.type); k++) {
+      // offsets is used as a cursor, and restored below
+      s->users[s->offsets[level[op.input[k]]]++] = i * 2 + k;
+    }
+  }
+  for (len_t k = nsched; k-- > 1;) {
+    s->offsets[k] = s->offsets[k - 1];
+  }
+  s->offsets[0] = 0;
 }
 
-idx_t vsub(idx_t a, idx_t b) {
-  idx_t pushed = tpushval(tapeval(a) - tapeval(b));
-  TAPE.ops[pushed].type = OP_SUB;
-  TAPE.ops[pushed].input[0] = a;
-  TAPE.ops[pushed].input[1] = b;
-  TAPE.ops[pushed].output = pushed;
-  TAPE.grads[pushed] = 0;
-  return pushed;
+sched_t *schedcreate(idx_t root) {
+  len_t nbuf = schedsize(root);
+  void *buffer = GRADINO_ALLOC(sizeof(sched_t) + nbuf);
+  if (!buffer)
+    return NULL;
+  sched_t *s = buffer;
+  schedinit(s, root, nbuf, (char *)buffer + sizeof(sched_t));
+  return s;
 }
 
-idx_t vmul(idx_t a, idx_t b) {
-  idx_t pushed = tpushval(tapeval(a) * tapeval(b));
-  TAPE.ops[pushed].type = OP_MUL;
-  TAPE.ops[pushed].input[0] = a;
-  TAPE.ops[pushed].input[1] = b;
-  TAPE.ops[pushed].output = pushed;
-  TAPE.grads[pushed] = 0;
-  return pushed;
+// Gradient of the records order[from..to] pulled from their users
+static void schedpull(const sched_t *s, const tape_t *t, len_t from,
+                      len_t to) {
+  for (len_t k = from; k < to; k++) {
+    value_t grad = 0;
+    for (len_t u = s->offsets[k]; u < s->offsets[k + 1]; u++) {
+      idx_t out = s->users[u] / 2;
+      idx_t slot = s->users[u] % 2;
+      const op_t *op = &t->ops[out];
+      switch (op->type) {
+      case OP_ADD:
+        grad += t->grads[out];
+        break;
+      case OP_SUB:
+        grad += slot ? -t->grads[out] : t->grads[out];
+        break;
+      case OP_MUL:
+        grad += t->grads[out] * t->values[op->input[1 - slot]];
+        break;
+      case OP_TANH:
+        grad += (1.0 - t->values[out] * t->values[out]) * t->grads[out];
+        break;
+      case OP_CONST:
+      default:
+        unreacheable();
+        break;
+      }
+    }
+    t->grads[s->order[k]] += grad;
+  }
+}
+
+#ifdef GRADINO_POSIX
+#include <pthread.h>
+
+static void schedwait(schedpool_t *p) {
+  pthread_mutex_lock(&p->mutex);
+  uint64_t generation = p->generation;
+  if (++p->waiting == p->nthreads) {
+    p->waiting = 0;
+    p->generation++;
+    pthread_cond_broadcast(&p->cond);
+  } else {
+    while (generation == p->generation)
+      pthread_cond_wait(&p->cond, &p->mutex);
+  }
+  pthread_mutex_unlock(&p->mutex);
+}
+
+static void schedwork(schedpool_t *p, const sched_t *s, const tape_t *t,
+                      len_t id) {
+  len_t nthreads = p->nthreads;
+  len_t nlevels = s->nlevels;
+
+  // Level 0 is the root, whose gradient is seeded by the caller. Narrow levels
+  // run on the first thread, and the others only wait for them before the
+  // next wide level.
+  bool serial = false, waited = false;
+  for (len_t l = 1; l < nlevels; l++) {
+    len_t from = s->levels[l];
+    len_t to = s->levels[l + 1];
+    if (to - from < SCHED_GRAIN * nthreads) {
+      if (id == 0)
+        schedpull(s, t, from, to);
+      serial = true;
+      waited = false;
+      continue;
+    }
+
+    if (serial)
+      schedwait(p);
+    len_t chunk = (to - from + nthreads - 1) / nthreads;
+    len_t start = from + chunk * id;
+    if (start < to)
+      schedpull(s, t, start, start + chunk < to ? start + chunk : to);
+    schedwait(p);
+    serial = false;
+    waited = true;
+  }
+  // Every call ends in a barrier, even with no level to split: the pool is
+  // free for the next call once schedbackprop returns
+  if (!waited)
+    schedwait(p);
+}
+
+// Run every call published on the pool until it stops. The schedule and the
+// tape of a call are read under the mutex, with the call they belong to.
+static void *schedthread(void *arg) {
+  schedworker_t *w = arg;
+  schedpool_t *p = w->pool;
+  uint64_t done = 0;
+  for (;;) {
+    pthread_mutex_lock(&p->mutex);
+    while (p->job == done && !p->stop)
+      pthread_cond_wait(&p->cond, &p->mutex);
+    bool stop = p->job == done;
+    done = p->job;
+    const sched_t *s = p->sched;
+    const tape_t *t = p->tape;
+    pthread_mutex_unlock(&p->mutex);
+    if (stop)
+      return NULL;
+    schedwork(p, s, t, w->id);
+  }
+}
+
+int schedstart(schedpool_t *p, len_t nthreads) {
+  panicif(!p, "pool cannot be null");
+  panicif(nthreads == 0, "must use at least one thread");
+
+  p->nthreads = 1;
+  p->sched = NULL;
+  p->tape = NULL;
+  p->job = 0;
+  p->stop = false;
+  p->waiting = 0;
+  p->generation = 0;
+  if (pthread_mutex_init(&p->mutex, NULL) != 0)
+    return -1;
+  if (pthread_cond_init(&p->cond, NULL) != 0) {
+    pthread_mutex_destroy(&p->mutex);
+    return -1;
+  }
+
+  // Run with as many threads as the system grants. They only read nthreads
+  // once a call is published, after it is final.
+  nthreads = nthreads < SCHED_MAX_THREADS ? nthreads : SCHED_MAX_THREADS;
+  for (len_t t = 1; t < nthreads; t++) {
+    p->workers[t].pool = p;
+    p->workers[t].id = t;
+    if (pthread_create(&p->threads[t], NULL, schedthread, &p->workers[t]) !=
+        0)
+      break;
+    p->nthreads++;
+  }
+  return 0;
+}
+
+void schedstop(schedpool_t *p) {
+  panicif(!p, "pool cannot be null");
+  pthread_mutex_lock(&p->mutex);
+  p->stop = true;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->mutex);
+  for (len_t t = 1; t < p->nthreads; t++) {
+    pthread_join(p->threads[t], NULL);
+  }
+  pthread_cond_destroy(&p->cond);
+  pthread_mutex_destroy(&p->mutex);
+}
+
+void schedbackprop(const sched_t *s, schedpool_t *pool) {
+  panicif(!s, "schedule cannot be null");
+  TAPE.grads[s->root] = 1.0;
+  if (!pool || pool->nthreads == 1) {
+    schedpull(s, &TAPE, s->levels[1], s->levels[s->nlevels]);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->sched = s;
+  pool->tape = &TAPE;
+  pool->job++;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+  schedwork(pool, s, &TAPE, 0);
 }
+#else
+void schedbackprop(const sched_t *s, schedpool_t *pool) {
+  panicif(!s, "schedule cannot be null");
+  (void)pool; // single-threaded without GRADINO_POSIX
+  TAPE.grads[s->root] = 1.0;
+  schedpull(s, &TAPE, s->levels[1], s->levels[s->nlevels]);
+}
+#endif
+
+///
+/// VALUE
+/// ===
+
+// Uniform in [-1, 1), from the 53 high bits of the generator
+static value_t vrand(void) {
+  return (double)(trand() >> 11) * 0x1.0p-52 - 1.0;
+}
+
+idx_t vconst(value_t value) {
+  // Compare the representation, as -Wfloat-equal rightfully forbids ==
+  for (len_t i = 0; i < TAPE.nconsts; i++) {
+    if (memcmp(&TAPE.consts[i].value, &value, sizeof(value_t)) == 0)
+      return TAPE.consts[i].idx;
+  }
 
-idx_t vtanh(idx_t a) {
-  value_t val = tapeval(a);
-  idx_t pushed = tpushval(tanh(val));
-  TAPE.ops[pushed].type = OP_TANH;
-  TAPE.ops[pushed].input[0] = a;
-  TAPE.ops[pushed].output = pushed;
-  TAPE.grads[pushed] = 0;
+  idx_t pushed = vfrom(value);
+  if (TAPE.nconsts < GRADINO_NCONSTS) {
+    TAPE.consts[TAPE.nconsts].value = value;
+    TAPE.consts[TAPE.nconsts].idx = pushed;
+    TAPE.nconsts++;
+  }
   return pushed;
 }
 
@@ -264,8 +921,14 @@ void vdbg(idx_t a, const char *label) {
 
   printf("// ");
 
+  // Records of a segment are not available, only their values
+  if (a < TAPE.base) {
+    printf("shared\n");
+    return;
+  }
+
   // Safe. At this point tat would have already panic-ed otherwise
-  op_t op = TAPE.ops[a];
+  op_t op = tapeop(a);
   switch (op.type) {
   case OP_CONST:
     printf("% 4.3f", tapeval(op.input[0]));
@@ -288,6 +951,30 @@ void vdbg(idx_t a, const char *label) {
   printf("\n");
 }
 
+///
+/// DUAL
+/// ===
+
+dual_t dfrom(value_t val, value_t tan) {
+  dual_t d;
+  d.val = val;
+  d.tan = tan;
+  return d;
+}
+
+dual_t dadd(dual_t a, dual_t b) { return dfrom(a.val + b.val, a.tan + b.tan); }
+
+dual_t dsub(dual_t a, dual_t b) { return dfrom(a.val - b.val, a.tan - b.tan); }
+
+dual_t dmul(dual_t a, dual_t b) {
+  return dfrom(a.val * b.val, a.tan * b.val + a.val * b.tan);
+}
+
+dual_t dtanh(dual_t a) {
+  value_t val = tanh(a.val);
+  return dfrom(val, (1.0 - val * val) * a.tan);
+}
+
 ///
 /// VECTOR
 /// ===
@@ -306,6 +993,15 @@ void vecdbg(vec_t *sl, const char *label) {
   }
 }
 
+void vecremap(vec_t *vec, const idx_t *remap) {
+  for (idx_t i = 0; i < vec->len; i++) {
+    idx_t idx = remap[vec->at[i]];
+    paniciff(idx == IDX_NONE, "value %lu was removed from the tape",
+             vec->at[i]);
+    vec->at[i] = idx;
+  }
+}
+
 ///
 /// PERCEPTRON
 /// ===
@@ -321,23 +1017,103 @@ static void pinit(ptron_t *p, len_t nparams, idx_t *params) {
   }
 }
 
+// Sum the count values recorded contiguously from first, pairwise. Each round
+// of partial sums is contiguous too, hence no bookkeeping is needed. Pairwise
+// summation keeps the graph log(n) deep instead of n deep, which is what lets
+// a schedule process the perceptron in parallel.
+// Records at most 2 * count records, which the caller must have reserved.
+static idx_t psum(idx_t first, len_t count) {
+  if (count == 0)
+    return vconst(0);
+  if (count == 1)
+    return first;
+
+  idx_t zero = vconst(0);
+  while (count > 1) {
+    idx_t next = tapemark();
+    for (idx_t k = 0; k + 1 < count; k += 2) {
+      tput(tval(first + k) + tval(first + k + 1), OP_ADD, first + k,
+           first + k + 1);
+    }
+    // Carry the odd one out into the next round
+    if (count % 2)
+      tput(tval(first + count - 1), OP_ADD, first + count - 1, zero);
+    first = next;
+    count = (count + 1) / 2;
+  }
+  return first;
+}
+
+// Records for an activation over n inputs: products, sums, bias and tanh
+#define PRECORDS(N) (3 * (N) + 2)
+
+// Records PRECORDS(input->len) records at most, which the caller must have
+// reserved.
 static idx_t pactivate(const ptron_t *p, const vec_t *input) {
   panicif(!p, "ptron cannot be null");
   panicif(!input, "input cannot be null");
   paniciff(input->len != p->len - 1, "invalid input len: expected %lu, got %lu",
            p->len - 1, input->len);
 
-  // dot product
-  idx_t sum = vfrom(0);
+  // Dot product
+  idx_t first = tapemark();
   for (idx_t i = 0; i < input->len; i++) {
     idx_t w = p->at[i];
     idx_t x = input->at[i];
-    idx_t prd = vmul(w, x);
-    sum = vadd(sum, prd);
+    tput(tval(w) * tval(x), OP_MUL, w, x);
+  }
+  idx_t sum = psum(first, input->len);
+
+  idx_t bias = p->at[p->len - 1];
+  idx_t activation = tput(tval(sum) + tval(bias), OP_ADD, sum, bias);
+  return tput(tanh(tval(activation)), OP_TANH, activation, activation);
+}
+
+// Same as pactivate, but only for the nonzero entries of a sparse input
+static idx_t psparse(const ptron_t *p, const svec_t *input) {
+  idx_t first = tapemark();
+  for (idx_t i = 0; i < input->len; i++) {
+    paniciff(input->at[i].pos >= p->len - 1,
+             "sparse position %lu out of bounds (len=%lu)", input->at[i].pos,
+             p->len - 1);
+    idx_t w = p->at[input->at[i].pos];
+    idx_t x = input->at[i].val;
+    tput(tval(w) * tval(x), OP_MUL, w, x);
   }
+  idx_t sum = psum(first, input->len);
 
-  idx_t activation = vadd(sum, p->at[p->len - 1]);
-  return vtanh(activation);
+  idx_t bias = p->at[p->len - 1];
+  idx_t activation = tput(tval(sum) + tval(bias), OP_ADD, sum, bias);
+  return tput(tanh(tval(activation)), OP_TANH, activation, activation);
+}
+
+// Same as pactivate, for a pruned perceptron whose weights read the inputs at
+// cols
+static idx_t ppruned(const ptron_t *p, const len_t *cols, const vec_t *input) {
+  idx_t first = tapemark();
+  for (idx_t i = 0; i < p->len - 1; i++) {
+    idx_t w = p->at[i];
+    idx_t x = input->at[cols[i]];
+    tput(tval(w) * tval(x), OP_MUL, w, x);
+  }
+  idx_t sum = psum(first, p->len - 1);
+
+  idx_t bias = p->at[p->len - 1];
+  idx_t activation = tput(tval(sum) + tval(bias), OP_ADD, sum, bias);
+  return tput(tanh(tval(activation)), OP_TANH, activation, activation);
+}
+
+// Forward-mode counterpart of pactivate. Parameters have zero tangent.
+static dual_t pjvp(const ptron_t *p, const dual_t *input) {
+  value_t val = 0;
+  value_t tan = 0;
+  for (idx_t i = 0; i < p->len - 1; i++) {
+    value_t w = tval(p->at[i]);
+    val += w * input[i].val;
+    tan += w * input[i].tan;
+  }
+  val = tanh(val + tval(p->at[p->len - 1]));
+  return dfrom(val, (1.0 - val * val) * tan);
 }
 
 static void pdbg(ptron_t *p, const char *label) {
@@ -353,7 +1129,38 @@ static void pdbg(ptron_t *p, const char *label) {
 /// LAYER
 /// ===
 
-static void linit(layer_t *l, len_t nin, len_t nout, ptron_t *ptrons, idx_t *params) {
+// Number of output positions of a convolution
+static len_t convpositions(const conv_t *c) {
+  return ((c->height - c->kernel) / c->stride + 1) *
+         ((c->width - c->kernel) / c->stride + 1);
+}
+
+// Offset in the input of the top-left corner of the field of a position
+static len_t convorigin(const conv_t *c, idx_t pos) {
+  len_t ow = (c->width - c->kernel) / c->stride + 1;
+  return ((pos / ow) * c->stride * c->width + (pos % ow) * c->stride) *
+         c->channels;
+}
+
+static void convcheck(const conv_t *c, len_t nin, len_t nout) {
+  panicif(c->stride == 0, "convolution stride must be positive");
+  panicif(c->kernel == 0 || c->kernel > c->height || c->kernel > c->width,
+          "convolution kernel must fit the input");
+  paniciff(nin != c->height * c->width * c->channels,
+           "convolution input len: expected %lu, got %lu",
+           c->height * c->width * c->channels, nin);
+  paniciff(nout != convpositions(c) * c->filters,
+           "convolution output len: expected %lu, got %lu",
+           convpositions(c) * c->filters, nout);
+  (void)c, (void)nin, (void)nout; // silence unused warning for release builds
+}
+
+static len_t lnptrons(const layer_t *l) {
+  return l->conv.filters > 0 ? l->conv.filters : l->len;
+}
+
+static void linit(layer_t *l, len_t nin, len_t nout, const conv_t *conv,
+                  ptron_t *ptrons, idx_t *params) {
   panicif(!l, "layer cannot be empty");
   panicif(nin == 0, "input size must be positive");
   panicif(nout == 0, "output size must be positive");
@@ -362,29 +1169,117 @@ static void linit(layer_t *l, len_t nin, len_t nout, ptron_t *ptrons, idx_t *par
 
   l->len = nout;
   l->at = ptrons;
+  l->nin = nin;
+  l->conv = conv ? *conv : (conv_t){0};
+  l->rows = NULL;
+  l->cols = NULL;
 
   // nparams for a perceptron is size of input + 1, since the input needs to be
-  // as big as the weights
-  len_t pnparams = nin + 1;
-  for (idx_t i = 0; i < nout; i++) {
+  // as big as the weights. Filters only see their receptive field
+  len_t pnparams =
+      conv ? conv->kernel * conv->kernel * conv->channels + 1 : nin + 1;
+  for (idx_t i = 0; i < lnptrons(l); i++) {
     idx_t *pvalues = params + pnparams * i;
     pinit(&ptrons[i], pnparams, pvalues);
   }
 }
 
-static void lactivate(const layer_t *l, const vec_t *input, vec_t *result) {
+// Convolution as im2col: gather the receptive field of each output position
+// in the patch, then multiply it by every filter
+static void lconv(const layer_t *l, const vec_t *input, vec_t *patch,
+                  vec_t *result) {
+  const conv_t *c = &l->conv;
+  len_t run = c->kernel * c->channels;
+  len_t npos = convpositions(c);
+  vec_t field = {run * c->kernel, patch->at};
+  treserve(npos * c->filters * PRECORDS(field.len));
+  for (idx_t pos = 0; pos < npos; pos++) {
+    const idx_t *origin = input->at + convorigin(c, pos);
+    // Rows of the field are contiguous in the input
+    for (idx_t ky = 0; ky < c->kernel; ky++) {
+      const idx_t *row = origin + ky * c->width * c->channels;
+      for (idx_t j = 0; j < run; j++) {
+        field.at[ky * run + j] = row[j];
+      }
+    }
+    for (idx_t f = 0; f < c->filters; f++) {
+      result->at[pos * c->filters + f] = pactivate(&l->at[f], &field);
+    }
+  }
+}
+
+static void lactivate(const layer_t *l, const vec_t *input, vec_t *patch,
+                      vec_t *result) {
   panicif(l->len == 0, "layer is empty");
   paniciff(result->len != l->len,
            "unexpected result len: expected %lu, got %lu", l->len, result->len);
+  if (l->conv.filters > 0) {
+    lconv(l, input, patch, result);
+    return;
+  }
+  treserve(l->len * PRECORDS(input->len));
+  if (l->rows) {
+    for (idx_t i = 0; i < l->len; i++) {
+      result->at[i] = ppruned(&l->at[i], l->cols + l->rows[i], input);
+    }
+    return;
+  }
   for (idx_t i = 0; i < l->len; i++) {
     result->at[i] = pactivate(&l->at[i], input);
   }
 }
 
+static void ljvp(const layer_t *l, const dual_t *input, dual_t *result) {
+  const conv_t *c = &l->conv;
+  if (l->rows) {
+    for (idx_t i = 0; i < l->len; i++) {
+      const ptron_t *p = &l->at[i];
+      const len_t *cols = l->cols + l->rows[i];
+      value_t val = 0;
+      value_t tan = 0;
+      for (idx_t j = 0; j < p->len - 1; j++) {
+        value_t w = tval(p->at[j]);
+        val += w * input[cols[j]].val;
+        tan += w * input[cols[j]].tan;
+      }
+      val = tanh(val + tval(p->at[p->len - 1]));
+      result[i] = dfrom(val, (1.0 - val * val) * tan);
+    }
+    return;
+  }
+  if (c->filters == 0) {
+    for (idx_t i = 0; i < l->len; i++) {
+      result[i] = pjvp(&l->at[i], input);
+    }
+    return;
+  }
+
+  len_t run = c->kernel * c->channels;
+  len_t npos = convpositions(c);
+  for (idx_t pos = 0; pos < npos; pos++) {
+    const dual_t *origin = input + convorigin(c, pos);
+    for (idx_t f = 0; f < c->filters; f++) {
+      const ptron_t *p = &l->at[f];
+      value_t val = 0;
+      value_t tan = 0;
+      for (idx_t ky = 0; ky < c->kernel; ky++) {
+        const dual_t *row = origin + ky * c->width * c->channels;
+        for (idx_t j = 0; j < run; j++) {
+          value_t w = tval(p->at[ky * run + j]);
+          val += w * row[j].val;
+          tan += w * row[j].tan;
+        }
+      }
+      val = tanh(val + tval(p->at[p->len - 1]));
+      result[pos * c->filters + f] = dfrom(val, (1.0 - val * val) * tan);
+    }
+  }
+}
+
 static void ldbg(layer_t *l, const char *label) {
   printf("%s\n", label);
   char buf[32];
-  for (idx_t i = 0; i < l->len; i++) {
+  for (idx_t i = 0; i < lnptrons(l); i++) {
     snprintf(buf, sizeof(buf), "ptron[%lu]", i);
     pdbg(&l->at[i], buf);
   }
@@ -394,33 +1289,54 @@ static void ldbg(layer_t *l, const char *label) {
 /// NETWORK
 /// ===
 
-union netalign {
-  ptron_t p;
-  layer_t l;
-  idx_t i;
-};
-
-#define MAX_ALIGN sizeof(union netalign)
+// No member of the buffer needs more than 16 bytes of alignment. The rounding
+// below needs a power of two, which sizeof(layer_t) is not.
+#define MAX_ALIGN ((size_t)16)
 
-len_t netsize(len_t nlens, len_t *llens) {
+// Count the perceptrons and parameters of a network with given layer sizes,
+// along with its widest layer and its largest convolution field
+static void netcount(len_t nlens, len_t *llens, const conv_t *convs,
+                     len_t *nptrons, len_t *nparams, len_t *nscratch,
+                     len_t *npatch) {
   panicif(nlens == 0 || !llens, "layers must be defined and not empty");
-  len_t nparams = 0;
-  len_t nptrons = 0;
-  len_t nscratch = llens[0];
+  *nparams = 0;
+  *nptrons = 0;
+  *nscratch = llens[0];
+  *npatch = 0;
   for (len_t i = 1; i < nlens; i++) {
-    nparams += (llens[i - 1] + 1) * llens[i];
-    nptrons += llens[i];
-    nscratch = max(llens[i], nscratch);
+    const conv_t *c = convs && convs[i - 1].filters > 0 ? &convs[i - 1] : NULL;
+    if (c) {
+      convcheck(c, llens[i - 1], llens[i]);
+      len_t field = c->kernel * c->kernel * c->channels;
+      *nparams += (field + 1) * c->filters;
+      *nptrons += c->filters;
+      *npatch = max(field, *npatch);
+    } else {
+      *nparams += (llens[i - 1] + 1) * llens[i];
+      *nptrons += llens[i];
+    }
+    *nscratch = max(llens[i], *nscratch);
   }
+}
+
+len_t netsizeconv(len_t nlens, len_t *llens, const conv_t *convs) {
+  len_t nptrons, nparams, nscratch, npatch;
+  netcount(nlens, llens, convs, &nptrons, &nparams, &nscratch, &npatch);
   return MAX_ALIGN + sizeof(ptron_t) * nptrons + sizeof(idx_t) * nparams +
-         sizeof(layer_t) * nlens + nscratch * sizeof(idx_t);
+         sizeof(layer_t) * nlens + 2 * nscratch * sizeof(idx_t) +
+         2 * nscratch * sizeof(dual_t) + npatch * sizeof(idx_t);
 }
 
-void netinit(net_t *n, len_t nlens, len_t *llens, len_t nbuf, char *buffer) {
+len_t netsize(len_t nlens, len_t *llens) {
+  return netsizeconv(nlens, llens, NULL);
+}
+
+void netinitconv(net_t *n, len_t nlens, len_t *llens, const conv_t *convs,
+                 len_t nbuf, char *buffer) {
   panicif(!buffer, "must provide buffer");
-  paniciff(nbuf < netsize(nlens, llens),
+  paniciff(nbuf < netsizeconv(nlens, llens, convs),
            "buffer too small; expected at least %lu, got %lu",
-           netsize(nlens, llens), nbuf);
+           netsizeconv(nlens, llens, convs), nbuf);
   (void)nbuf; // silence unused warning for release builds
 
   uintptr_t addr = (uintptr_t)buffer;
@@ -436,73 +1352,667 @@ void netinit(net_t *n, len_t nlens, len_t *llens, len_t nbuf, char *buffer) {
 
   len_t nptrons = 0;
   for (len_t i = 1; i < nlens; i++)
-    nptrons += llens[i];
+    nptrons += convs && convs[i - 1].filters > 0 ? convs[i - 1].filters
+                                                 : llens[i];
 
   ptr = (ptron_t *)ptr + nptrons;
   idx_t *params = ptr;
 
-  linit(&n->layers.at[0], llens[0], llens[1], ptrons, params);
-  len_t nscratch = llens[0];
-
-  len_t param_offset = llens[1] * (llens[0] + 1);
-  len_t ptron_offset = llens[1];
-  ptron_t *lptrons;
-  idx_t *lparams;
-  for (len_t i = 1; i < nlens - 1; i++) {
-    lptrons = ptrons + ptron_offset;
-    lparams = params + param_offset;
+  // Intern the zero every perceptron activation starts from, so that it lives
+  // below any mark taken after netinit
+  vconst(0);
 
-    linit(&n->layers.at[i], llens[i], llens[i + 1], lptrons, lparams);
-    nscratch = max(llens[i], nscratch);
-
-    param_offset += llens[i + 1] * (llens[i] + 1);
-    ptron_offset += llens[i + 1];
+  len_t nscratch = llens[0];
+  len_t npatch = 0;
+  len_t param_offset = 0;
+  len_t ptron_offset = 0;
+  for (len_t i = 0; i < nlens - 1; i++) {
+    const conv_t *c = convs && convs[i].filters > 0 ? &convs[i] : NULL;
+    layer_t *l = &n->layers.at[i];
+    linit(l, llens[i], llens[i + 1], c, ptrons + ptron_offset,
+          params + param_offset);
+    nscratch = max(llens[i + 1], nscratch);
+    if (c)
+      npatch = max(l->at[0].len - 1, npatch);
+
+    param_offset += lnptrons(l) * l->at[0].len;
+    ptron_offset += lnptrons(l);
   }
 
-  nscratch = max(llens[nlens - 1], nscratch);
-
   n->params.at = params;
   n->params.len = param_offset;
 
-  // Reserve some space at the end of the buffer for the scratch area that we
-  // need during the forward pass
+  // Reserve some space at the end of the buffer for the scratch areas that we
+  // need during the forward passes: one buffer to read a layer's input from
+  // and one to write its output to
   ptr = (idx_t *)ptr + n->params.len;
   n->scratch.at = ptr;
-  n->scratch.len = nscratch;
+  n->scratch.len = 2 * nscratch;
+
+  ptr = (idx_t *)ptr + n->scratch.len;
+  n->dual.at = ptr;
+  n->dual.len = 2 * nscratch;
+
+  ptr = (dual_t *)ptr + n->dual.len;
+  n->patch.at = ptr;
+  n->patch.len = npatch;
 }
 
-net_t *netcreate(len_t nlens, len_t *llens) {
-  len_t nbuf = netsize(nlens, llens);
+void netinit(net_t *n, len_t nlens, len_t *llens, len_t nbuf, char *buffer) {
+  netinitconv(n, nlens, llens, NULL, nbuf, buffer);
+}
+
+net_t *netcreateconv(len_t nlens, len_t *llens, const conv_t *convs) {
+  len_t nbuf = netsizeconv(nlens, llens, convs);
   void *buffer = GRADINO_ALLOC(sizeof(net_t) + nbuf);
   if (!buffer)
     return NULL;
   net_t *n = buffer;
-  netinit(n, nlens, llens, nbuf, (char *)buffer + sizeof(net_t));
+  netinitconv(n, nlens, llens, convs, nbuf, (char *)buffer + sizeof(net_t));
   return n;
 }
 
+net_t *netcreate(len_t nlens, len_t *llens) {
+  return netcreateconv(nlens, llens, NULL);
+}
+
+size_t netviewsize(const net_t *n) {
+  panicif(!n, "network cannot be null");
+  return MAX_ALIGN + n->scratch.len * sizeof(idx_t) +
+         n->dual.len * sizeof(dual_t) + n->patch.len * sizeof(idx_t);
+}
+
+void netview(net_t *dst, const net_t *src, len_t nbuf, char *buffer) {
+  panicif(!dst || !src, "networks cannot be null");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < netviewsize(src),
+           "buffer too small; expected at least %lu, got %lu",
+           netviewsize(src), nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  uintptr_t addr = (uintptr_t)buffer;
+  uintptr_t aligned = (addr + MAX_ALIGN - 1) & ~(MAX_ALIGN - 1);
+
+  // Layers and parameters are only ever read by the forward passes
+  *dst = *src;
+
+  void *ptr = (void *)aligned;
+  dst->scratch.at = ptr;
+  ptr = (idx_t *)ptr + dst->scratch.len;
+  dst->dual.at = ptr;
+  ptr = (dual_t *)ptr + dst->dual.len;
+  dst->patch.at = ptr;
+}
+
 #undef MAX_ALIGN
 
-void netfwd(net_t *n, const vec_t *input, vec_t *result) {
-  paniciff(input->len != n->layers.at->at[0].len - 1,
-           "invalid input len: expected %lu, got %lu", input->len,
-           n->layers.at->at[0].len - 1);
+void netrand(const net_t *n, init_t init) {
+  panicif(!n, "network cannot be null");
+  panicif(TAPE.base > 0, "parameters of a segment are read-only");
+
+  for (idx_t l = 0; l < n->layers.len; l++) {
+    const layer_t *layer = &n->layers.at[l];
+    const conv_t *c = &layer->conv;
+    // Pruned layers are initialized as the dense layer they come from, as when
+    // rewinding surviving weights to a fresh initialization
+    double fanin = layer->rows ? (double)layer->nin
+                               : (double)(layer->at[0].len - 1);
+    double fanout = c->filters > 0
+                        ? (double)(c->filters * c->kernel * c->kernel)
+                        : (double)layer->len;
+
+    value_t scale = 1.0;
+    bool bias = true;
+    switch (init) {
+    case INIT_UNIFORM:
+      break;
+    case INIT_XAVIER:
+      scale = sqrt(6.0 / (fanin + fanout));
+      bias = false;
+      break;
+    case INIT_HE:
+      scale = sqrt(6.0 / fanin);
+      bias = false;
+      break;
+    default:
+      unreacheable();
+      break;
+    }
+
+    // Perceptrons of a pruned layer have their own number of weights, in
+    // no particular place on the tape, hence each one is walked by index
+    for (idx_t i = 0; i < lnptrons(layer); i++) {
+      const ptron_t *p = &layer->at[i];
+      for (idx_t j = 0; j < p->len - 1; j++) {
+        TAPE.values[p->at[j]] = vrand() * scale;
+      }
+      TAPE.values[p->at[p->len - 1]] = bias ? vrand() : 0;
+    }
+  }
+}
+
+seg_t netfreeze(const net_t *n) {
+  panicif(!n, "network cannot be null");
+  panicif(TAPE.base > 0, "cannot freeze a tape attached to a segment");
+
+  // The segment spans from the bottom of the tape to the last parameter
+  idx_t top = 0;
+  for (len_t j = 0; j < n->params.len; j++) {
+    top = max(top, n->params.at[j] + 1);
+  }
+
+  seg_t seg;
+  seg.values = TAPE.values;
+  seg.len = top;
+  seg.nconsts = 0;
+  for (len_t i = 0; i < TAPE.nconsts && TAPE.consts[i].idx < top; i++) {
+    seg.consts[seg.nconsts++] = TAPE.consts[i];
+  }
+  return seg;
+}
 
+void netfwd(net_t *n, const vec_t *input, vec_t *result) {
+  paniciff(input->len != n->layers.at->nin,
+           "invalid input len: expected %lu, got %lu", n->layers.at->nin,
+           input->len);
+
+  PERF_BEGIN(PERF_FWD);
+  // A layer cannot write its output over the input it is still reading, so
+  // hidden layers alternate between the two halves of the scratch area
+  len_t half = n->scratch.len / 2;
   vec_t linput = *input;
+  vec_t loutput;
+  for (idx_t i = 0; i < n->layers.len - 1; i++) {
+    loutput.at = linput.at == n->scratch.at ? n->scratch.at + half
+                                            : n->scratch.at;
+    loutput.len = n->layers.at[i].len;
+    lactivate(&n->layers.at[i], &linput, &n->patch, &loutput);
+    linput = loutput;
+  }
+  lactivate(&n->layers.at[n->layers.len - 1], &linput, &n->patch, result);
+  PERF_END(PERF_FWD);
+}
+
+void netfwdsparse(net_t *n, const svec_t *input, vec_t *result) {
+  const layer_t *first = &n->layers.at[0];
+  panicif(first->conv.filters > 0 || first->rows,
+          "sparse inputs need a fully connected, unpruned first layer");
+  PERF_BEGIN(PERF_FWD);
+  treserve(first->len * PRECORDS(input->len));
+  if (n->layers.len == 1) {
+    paniciff(result->len != first->len,
+             "unexpected result len: expected %lu, got %lu", first->len,
+             result->len);
+    for (idx_t i = 0; i < first->len; i++) {
+      result->at[i] = psparse(&first->at[i], input);
+    }
+    PERF_END(PERF_FWD);
+    return;
+  }
+
+  vec_t hidden;
+  hidden.at = n->scratch.at;
+  hidden.len = first->len;
+  for (idx_t i = 0; i < first->len; i++) {
+    hidden.at[i] = psparse(&first->at[i], input);
+  }
+
+  // The remaining layers are dense, as in netfwd
+  len_t half = n->scratch.len / 2;
+  vec_t linput = hidden;
+  vec_t loutput;
+  for (idx_t i = 1; i < n->layers.len - 1; i++) {
+    loutput.at = linput.at == n->scratch.at ? n->scratch.at + half
+                                            : n->scratch.at;
+    loutput.len = n->layers.at[i].len;
+    lactivate(&n->layers.at[i], &linput, &n->patch, &loutput);
+    linput = loutput;
+  }
+  lactivate(&n->layers.at[n->layers.len - 1], &linput, &n->patch, result);
+  PERF_END(PERF_FWD);
+}
+
+void netjvp(net_t *n, const dvec_t *input, dvec_t *result) {
+  paniciff(input->len != n->layers.at->nin,
+           "invalid input len: expected %lu, got %lu", n->layers.at->nin,
+           input->len);
+  paniciff(result->len != n->layers.at[n->layers.len - 1].len,
+           "invalid result len: expected %lu, got %lu",
+           n->layers.at[n->layers.len - 1].len, result->len);
+
+  len_t half = n->dual.len / 2;
+  const dual_t *linput = input->at;
+  dual_t *loutput = n->dual.at;
   for (idx_t i = 0; i < n->layers.len - 1; i++) {
-    n->scratch.len = n->layers.at[i].len;
-    lactivate(&n->layers.at[i], &linput, &n->scratch);
-    linput.at = n->scratch.at;
-    linput.len = n->scratch.len;
+    ljvp(&n->layers.at[i], linput, loutput);
+    linput = loutput;
+    loutput = loutput == n->dual.at ? n->dual.at + half : n->dual.at;
+  }
+  ljvp(&n->layers.at[n->layers.len - 1], linput, result->at);
+}
+
+#define MAX_ALIGN sizeof(value_t)
+
+// Room for the weights gathered at once, and for the im2col matrix of a row
+static void infersizes(const net_t *n, len_t *nweights, len_t *ncols) {
+  *nweights = n->scratch.len / 2 + 1;
+  *ncols = 0;
+  for (idx_t l = 0; l < n->layers.len; l++) {
+    const layer_t *layer = &n->layers.at[l];
+    if (layer->conv.filters == 0)
+      continue;
+    len_t field = layer->at[0].len - 1;
+    *nweights = max(layer->conv.filters * (field + 1), *nweights);
+    *ncols = max(convpositions(&layer->conv) * field, *ncols);
+  }
+}
+
+static size_t inferbytes(len_t width, len_t nweights, len_t ncols,
+                         len_t count) {
+  return MAX_ALIGN + sizeof(value_t) * (2 * count * width + nweights + ncols);
+}
+
+size_t infersize(const net_t *n, len_t count) {
+  panicif(!n, "network cannot be null");
+  len_t nweights, ncols;
+  infersizes(n, &nweights, &ncols);
+  return inferbytes(n->scratch.len / 2, nweights, ncols, count);
+}
+
+// Tape-free convolution over a batch. im2col lays the fields of every
+// position of a row out as a matrix, which is multiplied by the filters
+static void convinfer(const layer_t *l, const value_t *in, len_t count,
+                      value_t *out, value_t *weights, value_t *cols) {
+  const conv_t *c = &l->conv;
+  len_t run = c->kernel * c->channels;
+  len_t field = run * c->kernel;
+  len_t npos = convpositions(c);
+
+  for (idx_t f = 0; f < c->filters; f++) {
+    for (idx_t k = 0; k <= field; k++) {
+      weights[f * (field + 1) + k] = tval(l->at[f].at[k]);
+    }
+  }
+
+  for (idx_t r = 0; r < count; r++) {
+    const value_t *x = in + r * l->nin;
+    for (idx_t pos = 0; pos < npos; pos++) {
+      const value_t *origin = x + convorigin(c, pos);
+      for (idx_t ky = 0; ky < c->kernel; ky++) {
+        const value_t *row = origin + ky * c->width * c->channels;
+        for (idx_t j = 0; j < run; j++) {
+          cols[pos * field + ky * run + j] = row[j];
+        }
+      }
+    }
+
+    value_t *y = out + r * l->len;
+    for (idx_t pos = 0; pos < npos; pos++) {
+      const value_t *col = cols + pos * field;
+      for (idx_t f = 0; f < c->filters; f++) {
+        const value_t *w = weights + f * (field + 1);
+        value_t sum = w[field];
+        for (idx_t k = 0; k < field; k++) {
+          sum += w[k] * col[k];
+        }
+        y[pos * c->filters + f] = tanh(sum);
+      }
+    }
+  }
+}
+
+void netinfer(const net_t *n, const value_t *inputs, len_t count,
+              value_t *outputs, len_t nbuf, char *buffer) {
+  panicif(!n, "network cannot be null");
+  panicif(!inputs || !outputs, "must provide inputs and outputs");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < infersize(n, count),
+           "buffer too small; expected at least %lu, got %lu",
+           infersize(n, count), nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  uintptr_t addr = (uintptr_t)buffer;
+  uintptr_t aligned = (addr + MAX_ALIGN - 1) & ~(MAX_ALIGN - 1);
+
+  len_t width = n->scratch.len / 2;
+  len_t nweights, ncols;
+  infersizes(n, &nweights, &ncols);
+  value_t *rows[2] = {(value_t *)aligned, (value_t *)aligned + count * width};
+  value_t *weights = rows[1] + count * width;
+  value_t *cols = weights + nweights;
+
+  const value_t *in = inputs;
+  len_t nin = n->layers.at[0].nin;
+  for (idx_t l = 0; l < n->layers.len; l++) {
+    const layer_t *layer = &n->layers.at[l];
+    value_t *out = l == n->layers.len - 1 ? outputs : rows[l % 2];
+    if (layer->conv.filters > 0) {
+      convinfer(layer, in, count, out, weights, cols);
+      in = out;
+      nin = layer->len;
+      continue;
+    }
+    if (layer->rows) {
+      for (idx_t j = 0; j < layer->len; j++) {
+        const ptron_t *p = &layer->at[j];
+        const len_t *at = layer->cols + layer->rows[j];
+        len_t nnz = p->len - 1;
+        for (idx_t k = 0; k <= nnz; k++) {
+          weights[k] = tval(p->at[k]);
+        }
+        for (idx_t r = 0; r < count; r++) {
+          const value_t *x = in + r * nin;
+          value_t sum = weights[nnz];
+          for (idx_t k = 0; k < nnz; k++) {
+            sum += weights[k] * x[at[k]];
+          }
+          out[r * layer->len + j] = tanh(sum);
+        }
+      }
+      in = out;
+      nin = layer->len;
+      continue;
+    }
+    for (idx_t j = 0; j < layer->len; j++) {
+      // Gather the weights once, then sweep them over every row of the batch
+      const ptron_t *p = &layer->at[j];
+      for (idx_t k = 0; k <= nin; k++) {
+        weights[k] = tval(p->at[k]);
+      }
+      for (idx_t r = 0; r < count; r++) {
+        const value_t *x = in + r * nin;
+        value_t sum = weights[nin];
+        for (idx_t k = 0; k < nin; k++) {
+          sum += weights[k] * x[k];
+        }
+        out[r * layer->len + j] = tanh(sum);
+      }
+    }
+    in = out;
+    nin = layer->len;
+  }
+}
+
+#undef MAX_ALIGN
+
+// On-disk header of a network. Followed by the layer sizes as uint64_t and
+// the parameter values.
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t valuesize;
+  uint32_t nlens;
+} netheader_t;
+
+enum { NET_VERSION = 1 };
+static const char NET_MAGIC[4] = {'G', 'R', 'D', 'M'};
+
+int netsave(const net_t *n, const char *path) {
+  panicif(!n, "network cannot be null");
+  panicif(!path, "must provide path");
+
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    return -1;
+
+  netheader_t h;
+  memcpy(h.magic, NET_MAGIC, sizeof(h.magic));
+  h.version = NET_VERSION;
+  h.valuesize = sizeof(value_t);
+  h.nlens = (uint32_t)(n->layers.len + 1);
+  int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+  uint64_t llen = n->layers.at[0].nin;
+  ok = ok && fwrite(&llen, sizeof(llen), 1, f) == 1;
+  for (idx_t i = 0; i < n->layers.len; i++) {
+    llen = n->layers.at[i].len;
+    ok = ok && fwrite(&llen, sizeof(llen), 1, f) == 1;
+  }
+
+  for (idx_t i = 0; ok && i < n->params.len; i++) {
+    value_t v = tval(n->params.at[i]);
+    ok = fwrite(&v, sizeof(v), 1, f) == 1;
+  }
+
+  ok = fclose(f) == 0 && ok;
+  return ok ? 0 : -1;
+}
+
+int netload(const net_t *n, const char *path) {
+  panicif(!n, "network cannot be null");
+  panicif(!path, "must provide path");
+  panicif(TAPE.base > 0, "parameters of a segment are read-only");
+
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return -1;
+
+  netheader_t h;
+  int ok = fread(&h, sizeof(h), 1, f) == 1 &&
+           memcmp(h.magic, NET_MAGIC, sizeof(h.magic)) == 0 &&
+           h.version == NET_VERSION && h.valuesize == sizeof(value_t) &&
+           h.nlens == n->layers.len + 1;
+
+  uint64_t llen;
+  ok = ok && fread(&llen, sizeof(llen), 1, f) == 1 &&
+       llen == n->layers.at[0].nin;
+  for (idx_t i = 0; ok && i < n->layers.len; i++) {
+    ok = fread(&llen, sizeof(llen), 1, f) == 1 && llen == n->layers.at[i].len;
+  }
+
+  // Read everything before touching the tape, so that a truncated file
+  // leaves the network as it was
+  long start = ftell(f);
+  for (idx_t i = 0; ok && i < n->params.len; i++) {
+    value_t v;
+    ok = fread(&v, sizeof(v), 1, f) == 1;
+  }
+  ok = ok && fgetc(f) == EOF && fseek(f, start, SEEK_SET) == 0;
+  for (idx_t i = 0; ok && i < n->params.len; i++) {
+    ok = fread(&TAPE.values[n->params.at[i]], sizeof(value_t), 1, f) == 1;
   }
-  lactivate(&n->layers.at[n->layers.len - 1], &linput, result);
+
+  fclose(f);
+  return ok ? 0 : -1;
 }
 
 void netgdstep(const net_t *n, double rate) {
+  panicif(TAPE.base > 0, "parameters of a segment are read-only");
+  PERF_BEGIN(PERF_GDSTEP);
   for (len_t j = 0; j < n->params.len; j++) {
     idx_t idx = n->params.at[j];
     TAPE.values[idx] += TAPE.grads[idx] * -rate;
   }
+  PERF_END(PERF_GDSTEP);
+}
+
+static size_t fitbytes(size_t nacc, size_t ninfer, len_t nparams,
+                       len_t nsamples, len_t nin, len_t nout) {
+  // accumulator, best parameters and validation outputs, permutation, input
+  // and result indices, and validation pass
+  return nacc + sizeof(value_t) * (nparams + nout) +
+         sizeof(idx_t) * (nsamples + nin + nout) + ninfer;
+}
+
+size_t fitsize(const net_t *n, const fit_t *f) {
+  panicif(!n || !f, "network and configuration cannot be null");
+  len_t nin = n->layers.at[0].nin;
+  len_t nout = n->layers.at[n->layers.len - 1].len;
+  return fitbytes(accsize(n), infersize(n, 1), n->params.len, f->nsamples,
+                  nin, nout);
+}
+
+double fitrate(const fit_t *f, len_t epoch) {
+  panicif(!f, "configuration cannot be null");
+  if (epoch < f->warmup)
+    return f->rate * (double)(epoch + 1) / (double)f->warmup;
+
+  len_t since = epoch - f->warmup;
+  switch (f->decay) {
+  case DECAY_NONE:
+    return f->rate;
+  case DECAY_STEP:
+    panicif(f->decayevery == 0, "decayevery must be positive");
+    return f->rate * pow(f->decayrate, (double)(since / f->decayevery));
+  case DECAY_COSINE: {
+    // The last epoch runs at zero. A single epoch after the warmup keeps the
+    // full rate, as there is nothing to decay towards.
+    len_t span = f->epochs > f->warmup + 1 ? f->epochs - f->warmup - 1 : 1;
+    return f->rate * 0.5 * (1.0 + cos(acos(-1.0) * (double)since / (double)span));
+  }
+  default:
+    unreacheable();
+    return f->rate;
+  }
+}
+
+// Number of records netfit pushes for one sample besides the forward pass:
+// the inputs, then a constant, a difference, a square and a sum per output,
+// and the scale of LOSS_MEAN
+static len_t fitrecords(len_t nin, len_t nout) { return nin + 4 * nout + 2; }
+
+// Record the loss of result against a row of raw targets
+static idx_t fitloss(loss_t kind, const vec_t *result, const value_t *target) {
+  idx_t loss = vconst(0);
+  for (idx_t i = 0; i < result->len; i++) {
+    idx_t diff = vsub(vfrom(target[i]), result->at[i]);
+    loss = vadd(loss, vmul(diff, diff));
+  }
+
+  switch (kind) {
+  case LOSS_SQUARED:
+    break;
+  case LOSS_MEAN:
+    loss = vmul(loss, vfrom(1.0 / (value_t)result->len));
+    break;
+  default:
+    unreacheable();
+    break;
+  }
+  return loss;
+}
+
+// Mean loss over the validation split, computed without recording. Rows are
+// run one at a time through netinfer, whose buffer is passed along.
+static value_t fitvalid(const net_t *n, const fit_t *f, value_t *out,
+                        len_t ninfer, char *infer) {
+  len_t nin = n->layers.at[0].nin;
+  len_t nout = n->layers.at[n->layers.len - 1].len;
+  value_t sum = 0;
+  for (idx_t s = 0; s < f->nvalid; s++) {
+    netinfer(n, f->vinputs + s * nin, 1, out, ninfer, infer);
+    value_t loss = 0;
+    for (idx_t i = 0; i < nout; i++) {
+      value_t diff = f->vtargets[s * nout + i] - out[i];
+      loss += diff * diff;
+    }
+    sum += f->loss == LOSS_MEAN ? loss / (value_t)nout : loss;
+  }
+  return sum / (value_t)f->nvalid;
+}
+
+value_t netfit(net_t *n, const fit_t *f, len_t nbuf, char *buffer) {
+  panicif(!n || !f, "network and configuration cannot be null");
+  panicif(!f->inputs || !f->targets, "must provide inputs and targets");
+  panicif(f->batch == 0, "batch must be positive");
+  panicif(f->nvalid > 0 && (!f->vinputs || !f->vtargets),
+          "must provide validation inputs and targets");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < fitsize(n, f),
+           "buffer too small; expected at least %lu, got %lu", fitsize(n, f),
+           nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  len_t nin = n->layers.at[0].nin;
+  len_t nout = n->layers.at[n->layers.len - 1].len;
+
+  acc_t acc;
+  accinit(&acc, n, accsize(n), buffer);
+  value_t *best = acc.at + acc.len;
+  value_t *out = best + n->params.len;
+  idx_t *order = (idx_t *)(out + nout);
+  vec_t input, result;
+  vecinit(&input, nin, order + f->nsamples);
+  vecinit(&result, nout, order + f->nsamples + nin);
+  char *infer = (char *)(order + f->nsamples + nin + nout);
+  len_t ninfer = (len_t)infersize(n, 1);
+
+  for (idx_t i = 0; i < f->nsamples; i++) {
+    order[i] = i;
+  }
+
+  // Constants used by every sample live below the mark
+  vconst(0);
+  idx_t mark = tapemark();
+
+  value_t mean = 0;
+  value_t bestloss = INFINITY;
+  len_t stale = 0;
+  for (len_t epoch = 0; epoch < f->epochs; epoch++) {
+    double rate = fitrate(f, epoch);
+    if (f->shuffle) {
+      for (idx_t i = f->nsamples; i-- > 1;) {
+        idx_t j = (idx_t)(trand() % (i + 1));
+        idx_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+      }
+    }
+
+    value_t sum = 0;
+    for (idx_t s = 0; s < f->nsamples; s++) {
+      const value_t *x = f->inputs + order[s] * nin;
+      const value_t *y = f->targets + order[s] * nout;
+
+      tapereset(mark);
+      for (idx_t i = 0; i < nin; i++) {
+        input.at[i] = vfrom(x[i]);
+      }
+      netfwd(n, &input, &result);
+      idx_t loss = fitloss(f->loss, &result, y);
+      sum += tapeval(loss);
+
+      tapezerograd();
+      tapebackprop(loss);
+      if (f->batch == 1) {
+        netgdstep(n, rate);
+        continue;
+      }
+
+      acccollect(&acc, n);
+      if ((s + 1) % f->batch == 0 || s + 1 == f->nsamples)
+        accstep(&acc, n, rate);
+    }
+
+    tapereset(mark);
+    mean = f->nsamples > 0 ? sum / (value_t)f->nsamples : 0;
+
+    if (f->nvalid > 0) {
+      value_t loss = fitvalid(n, f, out, ninfer, infer);
+      if (loss < bestloss) {
+        bestloss = loss;
+        stale = 0;
+        for (idx_t j = 0; j < n->params.len; j++) {
+          best[j] = TAPE.values[n->params.at[j]];
+        }
+      } else {
+        stale++;
+      }
+    }
+
+    if (f->onepoch && !f->onepoch(epoch, mean, f->ctx))
+      break;
+    if (stale > 0 && stale == f->patience)
+      break;
+  }
+
+  if (f->nvalid > 0 && bestloss < INFINITY) {
+    for (idx_t j = 0; j < n->params.len; j++) {
+      TAPE.values[n->params.at[j]] = best[j];
+    }
+    return bestloss;
+  }
+  return mean;
 }
 
 void netdbg(const net_t *n, const char *label) {
@@ -514,3 +2024,1748 @@ void netdbg(const net_t *n, const char *label) {
     ldbg(&n->layers.at[i], buf);
   }
 }
+
+///
+/// GRADIENT ACCUMULATOR
+/// ===
+
+#define MAX_ALIGN sizeof(value_t)
+
+static size_t accbytes(len_t nparams) {
+  return MAX_ALIGN + sizeof(value_t) * nparams;
+}
+
+size_t accsize(const net_t *n) {
+  panicif(!n, "network cannot be null");
+  return accbytes(n->params.len);
+}
+
+void accinit(acc_t *a, const net_t *n, len_t nbuf, char *buffer) {
+  panicif(!a, "accumulator cannot be null");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < accsize(n),
+           "buffer too small; expected at least %lu, got %lu", accsize(n),
+           nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  uintptr_t addr = (uintptr_t)buffer;
+  uintptr_t aligned = (addr + MAX_ALIGN - 1) & ~(MAX_ALIGN - 1);
+
+  a->at = (value_t *)aligned;
+  a->len = n->params.len;
+  for (idx_t i = 0; i < a->len; i++) {
+    a->at[i] = 0;
+  }
+}
+
+acc_t *acccreate(const net_t *n) {
+  len_t nbuf = accsize(n);
+  void *buffer = GRADINO_ALLOC(sizeof(acc_t) + nbuf);
+  if (!buffer)
+    return NULL;
+  acc_t *a = buffer;
+  accinit(a, n, nbuf, (char *)buffer + sizeof(acc_t));
+  return a;
+}
+
+#undef MAX_ALIGN
+
+void acccollect(acc_t *a, const net_t *n) {
+  panicif(TAPE.base > 0, "parameters of a segment are read-only");
+  paniciff(a->len != n->params.len,
+           "accumulator size mismatch: expected %lu, got %lu", n->params.len,
+           a->len);
+  for (len_t j = 0; j < n->params.len; j++) {
+    a->at[j] += TAPE.grads[n->params.at[j]];
+  }
+}
+
+void accstep(acc_t *a, const net_t *n, double rate) {
+  panicif(TAPE.base > 0, "parameters of a segment are read-only");
+  paniciff(a->len != n->params.len,
+           "accumulator size mismatch: expected %lu, got %lu", n->params.len,
+           a->len);
+  for (len_t j = 0; j < n->params.len; j++) {
+    idx_t idx = n->params.at[j];
+    TAPE.values[idx] += a->at[j] * -rate;
+    a->at[j] = 0;
+  }
+}
+
+///
+/// DENSE NETWORK
+/// ===
+
+// No member of the buffer needs more than 16 bytes of alignment. The rounding
+// below needs a power of two, which sizeof(dlayer_t) is not.
+#define MAX_ALIGN ((size_t)16)
+
+size_t densesize(len_t nlens, len_t *llens) {
+  panicif(nlens < 2 || !llens, "layers must be defined and not empty");
+  len_t nvalues = llens[0];
+  len_t width = llens[0];
+  for (len_t i = 1; i < nlens; i++) {
+    // weights and biases, their gradients, and the activations
+    nvalues += 2 * (llens[i - 1] + 1) * llens[i] + llens[i];
+    width = max(llens[i], width);
+  }
+  nvalues += 2 * width;
+  return MAX_ALIGN + sizeof(dlayer_t) * (nlens - 1) + sizeof(value_t) * nvalues;
+}
+
+void denseinit(dense_t *d, len_t nlens, len_t *llens, len_t nbuf,
+               char *buffer) {
+  panicif(!d, "dense network cannot be null");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < densesize(nlens, llens),
+           "buffer too small; expected at least %lu, got %lu",
+           densesize(nlens, llens), nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  uintptr_t addr = (uintptr_t)buffer;
+  uintptr_t aligned = (addr + MAX_ALIGN - 1) & ~(MAX_ALIGN - 1);
+
+  void *ptr = (void *)aligned;
+  d->layers.len = nlens - 1;
+  d->layers.at = ptr;
+  ptr = (dlayer_t *)ptr + d->layers.len;
+
+  // Every layer owns a contiguous block: weights, biases, their gradients,
+  // and its activations
+  len_t width = llens[0];
+  value_t *values = ptr;
+  for (len_t i = 0; i < d->layers.len; i++) {
+    dlayer_t *l = &d->layers.at[i];
+    l->nin = llens[i];
+    l->nout = llens[i + 1];
+    panicif(l->nin == 0 || l->nout == 0, "layer sizes must be positive");
+
+    l->w = values;
+    values += l->nout * l->nin;
+    l->b = values;
+    values += l->nout;
+    l->dw = values;
+    values += l->nout * l->nin;
+    l->db = values;
+    values += l->nout;
+    l->out = values;
+    values += l->nout;
+    width = max(l->nout, width);
+  }
+
+  d->in = values;
+  values += llens[0];
+  d->delta = values;
+  d->width = width;
+
+  denserand(d, INIT_UNIFORM);
+  densezerograd(d);
+}
+
+dense_t *densecreate(len_t nlens, len_t *llens) {
+  len_t nbuf = densesize(nlens, llens);
+  void *buffer = GRADINO_ALLOC(sizeof(dense_t) + nbuf);
+  if (!buffer)
+    return NULL;
+  dense_t *d = buffer;
+  denseinit(d, nlens, llens, nbuf, (char *)buffer + sizeof(dense_t));
+  return d;
+}
+
+#undef MAX_ALIGN
+
+void denserand(const dense_t *d, init_t init) {
+  panicif(!d, "dense network cannot be null");
+  for (len_t i = 0; i < d->layers.len; i++) {
+    const dlayer_t *l = &d->layers.at[i];
+
+    value_t scale = 1.0;
+    bool bias = true;
+    switch (init) {
+    case INIT_UNIFORM:
+      break;
+    case INIT_XAVIER:
+      scale = sqrt(6.0 / (double)(l->nin + l->nout));
+      bias = false;
+      break;
+    case INIT_HE:
+      scale = sqrt(6.0 / (double)l->nin);
+      bias = false;
+      break;
+    default:
+      unreacheable();
+      break;
+    }
+
+    for (idx_t j = 0; j < l->nout * l->nin; j++) {
+      l->w[j] = vrand() * scale;
+    }
+    for (idx_t j = 0; j < l->nout; j++) {
+      l->b[j] = bias ? vrand() : 0;
+    }
+  }
+}
+
+void densefwd(dense_t *d, const vec_t *input, vec_t *result) {
+  panicif(!d, "dense network cannot be null");
+  const dlayer_t *last = &d->layers.at[d->layers.len - 1];
+  paniciff(input->len != d->layers.at[0].nin,
+           "invalid input len: expected %lu, got %lu", d->layers.at[0].nin,
+           input->len);
+  paniciff(result->len != last->nout,
+           "invalid result len: expected %lu, got %lu", last->nout,
+           result->len);
+
+  for (idx_t i = 0; i < input->len; i++) {
+    d->in[i] = tapeval(input->at[i]);
+  }
+
+  const value_t *in = d->in;
+  for (len_t k = 0; k < d->layers.len; k++) {
+    const dlayer_t *l = &d->layers.at[k];
+    for (idx_t j = 0; j < l->nout; j++) {
+      const value_t *row = l->w + j * l->nin;
+      value_t sum = 0;
+      for (idx_t i = 0; i < l->nin; i++) {
+        sum += row[i] * in[i];
+      }
+      l->out[j] = tanh(sum + l->b[j]);
+    }
+    in = l->out;
+  }
+
+  for (idx_t j = 0; j < last->nout; j++) {
+    result->at[j] = vfrom(last->out[j]);
+  }
+}
+
+void densebwd(dense_t *d, const vec_t *input, const vec_t *result) {
+  panicif(!d, "dense network cannot be null");
+  const dlayer_t *last = &d->layers.at[d->layers.len - 1];
+  paniciff(input->len != d->layers.at[0].nin,
+           "invalid input len: expected %lu, got %lu", d->layers.at[0].nin,
+           input->len);
+  paniciff(result->len != last->nout,
+           "invalid result len: expected %lu, got %lu", last->nout,
+           result->len);
+
+  // delta holds the gradient of the current layer's outputs and, once it is
+  // processed, of its inputs. The two rows take turns.
+  value_t *dout = d->delta;
+  value_t *din = d->delta + d->width;
+  for (idx_t j = 0; j < last->nout; j++) {
+    dout[j] = tapegrad(result->at[j]);
+  }
+
+  for (len_t k = d->layers.len; k-- > 0;) {
+    const dlayer_t *l = &d->layers.at[k];
+    const value_t *in = k > 0 ? d->layers.at[k - 1].out : d->in;
+
+    for (idx_t i = 0; i < l->nin; i++) {
+      din[i] = 0;
+    }
+    for (idx_t j = 0; j < l->nout; j++) {
+      // Through tanh, then into the parameters and the inputs
+      value_t delta = dout[j] * (1.0 - l->out[j] * l->out[j]);
+      const value_t *row = l->w + j * l->nin;
+      value_t *drow = l->dw + j * l->nin;
+      l->db[j] += delta;
+      for (idx_t i = 0; i < l->nin; i++) {
+        drow[i] += delta * in[i];
+        din[i] += delta * row[i];
+      }
+    }
+
+    value_t *tmp = dout;
+    dout = din;
+    din = tmp;
+  }
+
+  for (idx_t i = 0; i < input->len; i++) {
+    idx_t idx = input->at[i];
+    if (idx >= TAPE.base)
+      TAPE.grads[idx - TAPE.base] += dout[i];
+  }
+}
+
+void densezerograd(const dense_t *d) {
+  for (len_t k = 0; k < d->layers.len; k++) {
+    const dlayer_t *l = &d->layers.at[k];
+    for (idx_t j = 0; j < l->nout * l->nin; j++) {
+      l->dw[j] = 0;
+    }
+    for (idx_t j = 0; j < l->nout; j++) {
+      l->db[j] = 0;
+    }
+  }
+}
+
+void densegdstep(const dense_t *d, double rate) {
+  for (len_t k = 0; k < d->layers.len; k++) {
+    const dlayer_t *l = &d->layers.at[k];
+    for (idx_t j = 0; j < l->nout * l->nin; j++) {
+      l->w[j] += l->dw[j] * -rate;
+    }
+    for (idx_t j = 0; j < l->nout; j++) {
+      l->b[j] += l->db[j] * -rate;
+    }
+  }
+}
+
+///
+/// DATASET
+/// ===
+
+// On-disk header. Followed by padding up to DATA_OFFSET, the inputs and the
+// targets.
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t valuesize;
+  uint32_t reserved;
+  uint64_t nrows;
+  uint64_t nin;
+  uint64_t nout;
+} dataheader_t;
+
+enum { DATA_VERSION = 1, DATA_OFFSET = 64 };
+static const char DATA_MAGIC[4] = {'G', 'R', 'D', 'N'};
+
+int datawrite(const char *path, const value_t *inputs, const value_t *targets,
+              len_t nrows, len_t nin, len_t nout) {
+  panicif(!path, "must provide path");
+  panicif(nrows > 0 && (!inputs || !targets), "must provide rows");
+
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    return -1;
+
+  char header[DATA_OFFSET] = {0};
+  dataheader_t h;
+  memcpy(h.magic, DATA_MAGIC, sizeof(h.magic));
+  h.version = DATA_VERSION;
+  h.valuesize = sizeof(value_t);
+  h.reserved = 0;
+  h.nrows = nrows;
+  h.nin = nin;
+  h.nout = nout;
+  memcpy(header, &h, sizeof(h));
+
+  int ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+           fwrite(inputs, sizeof(value_t), nrows * nin, f) == nrows * nin &&
+           fwrite(targets, sizeof(value_t), nrows * nout, f) == nrows * nout;
+  ok = fclose(f) == 0 && ok;
+  return ok ? 0 : -1;
+}
+
+#ifdef GRADINO_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int dataopen(data_t *d, const char *path) {
+  panicif(!d, "dataset cannot be null");
+  panicif(!path, "must provide path");
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < DATA_OFFSET) {
+    close(fd);
+    return -1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  // The header is untrusted: bound every field before sizing the rows with it
+  dataheader_t h;
+  memcpy(&h, map, sizeof(h));
+  uint64_t nvalues = (size - DATA_OFFSET) / sizeof(value_t);
+  if (memcmp(h.magic, DATA_MAGIC, sizeof(h.magic)) != 0 ||
+      h.version != DATA_VERSION || h.valuesize != sizeof(value_t) ||
+      h.nin == 0 || h.nout == 0 || h.nin > nvalues || h.nout > nvalues ||
+      h.nrows > nvalues / (h.nin + h.nout) ||
+      DATA_OFFSET + sizeof(value_t) * h.nrows * (h.nin + h.nout) != size) {
+    munmap(map, size);
+    return -1;
+  }
+
+  d->map = map;
+  d->mapsize = size;
+  d->nrows = h.nrows;
+  d->nin = h.nin;
+  d->nout = h.nout;
+  d->inputs = (const value_t *)((const char *)map + DATA_OFFSET);
+  d->targets = d->inputs + d->nrows * d->nin;
+  return 0;
+}
+
+void dataclose(data_t *d) {
+  panicif(!d, "dataset cannot be null");
+  if (d->map)
+    munmap(d->map, d->mapsize);
+  d->map = NULL;
+  d->mapsize = 0;
+  d->inputs = NULL;
+  d->targets = NULL;
+  d->nrows = 0;
+}
+
+// Hint the kernel about the upcoming use of a range of rows. Advice is best
+// effort, so failures are ignored.
+static void dataadvise(const data_t *d, const value_t *rows, len_t width,
+                       idx_t first, len_t count, int advice) {
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t from = (uintptr_t)(rows + first * width);
+  uintptr_t to = (uintptr_t)(rows + (first + count) * width);
+  uintptr_t start = from & ~(page - 1);
+  if (start < (uintptr_t)d->map)
+    start = (uintptr_t)d->map;
+  if (to > start)
+    posix_madvise((void *)start, to - start, advice);
+}
+
+size_t dataitersize(const data_t *d, len_t block) {
+  panicif(!d, "dataset cannot be null");
+  panicif(block == 0, "block must be positive");
+  return sizeof(idx_t) + sizeof(idx_t) * ((d->nrows + block - 1) / block);
+}
+
+void dataiterinit(dataiter_t *it, const data_t *d, len_t block, bool shuffle,
+                  len_t nbuf, char *buffer) {
+  panicif(!it, "iterator cannot be null");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < dataitersize(d, block),
+           "buffer too small; expected at least %lu, got %lu",
+           dataitersize(d, block), nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  uintptr_t addr = (uintptr_t)buffer;
+  uintptr_t aligned = (addr + sizeof(idx_t) - 1) & ~(sizeof(idx_t) - 1);
+
+  it->data = d;
+  it->order = (idx_t *)aligned;
+  it->nblocks = (d->nrows + block - 1) / block;
+  it->block = block;
+  it->cursor = 0;
+  it->shuffle = shuffle;
+  for (idx_t i = 0; i < it->nblocks; i++) {
+    it->order[i] = i;
+  }
+
+  // Readahead only pays off when blocks are visited in file order
+  int advice = shuffle ? POSIX_MADV_RANDOM : POSIX_MADV_SEQUENTIAL;
+  posix_madvise(d->map, d->mapsize, advice);
+}
+
+bool datanext(dataiter_t *it, idx_t *first, len_t *count) {
+  panicif(!it, "iterator cannot be null");
+  const data_t *d = it->data;
+
+  if (it->cursor == it->nblocks) {
+    it->cursor = 0;
+    return false;
+  }
+
+  if (it->cursor == 0 && it->shuffle) {
+    for (idx_t i = it->nblocks; i-- > 1;) {
+      idx_t j = (idx_t)(trand() % (i + 1));
+      idx_t tmp = it->order[i];
+      it->order[i] = it->order[j];
+      it->order[j] = tmp;
+    }
+  }
+
+  idx_t block = it->order[it->cursor++];
+  *first = block * it->block;
+  *count = *first + it->block > d->nrows ? d->nrows - *first : it->block;
+
+  // Prefetch the block that comes next, while the caller works on this one
+  if (it->cursor < it->nblocks) {
+    idx_t nfirst = it->order[it->cursor] * it->block;
+    len_t ncount =
+        nfirst + it->block > d->nrows ? d->nrows - nfirst : it->block;
+    dataadvise(d, d->inputs, d->nin, nfirst, ncount, POSIX_MADV_WILLNEED);
+    dataadvise(d, d->targets, d->nout, nfirst, ncount, POSIX_MADV_WILLNEED);
+  }
+  return true;
+}
+#endif
+
+#ifdef GRADINO_POSIX
+///
+/// FEED
+/// ===
+
+#define MAX_ALIGN sizeof(value_t)
+
+size_t feedsize(len_t nslots, len_t batch, len_t nin, len_t nout) {
+  return MAX_ALIGN + sizeof(value_t) * nslots * batch * (nin + nout) +
+         sizeof(len_t) * nslots;
+}
+
+void feedinit(feed_t *f, len_t nslots, len_t batch, len_t nin, len_t nout,
+              feedfill_t fill, void *ctx, len_t nbuf, char *buffer) {
+  panicif(!f, "feed cannot be null");
+  panicif(!fill, "must provide fill callback");
+  panicif(nslots < 2, "feed needs at least two slots");
+  panicif(batch == 0, "batch must be positive");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < feedsize(nslots, batch, nin, nout),
+           "buffer too small; expected at least %lu, got %lu",
+           feedsize(nslots, batch, nin, nout), nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  uintptr_t addr = (uintptr_t)buffer;
+  uintptr_t aligned = (addr + MAX_ALIGN - 1) & ~(MAX_ALIGN - 1);
+
+  f->inputs = (value_t *)aligned;
+  f->targets = f->inputs + nslots * batch * nin;
+  f->counts = (len_t *)(f->targets + nslots * batch * nout);
+  f->nslots = nslots;
+  f->batch = batch;
+  f->nin = nin;
+  f->nout = nout;
+  f->fill = fill;
+  f->ctx = ctx;
+  f->seed = 0;
+  f->held = false;
+  f->stop = false;
+  f->head = 0;
+  f->tail = 0;
+}
+
+#undef MAX_ALIGN
+
+static void *feedthread(void *arg) {
+  feed_t *f = arg;
+  tapeseed(f->seed);
+
+  for (;;) {
+    pthread_mutex_lock(&f->mutex);
+    while (f->head - f->tail == f->nslots && !f->stop)
+      pthread_cond_wait(&f->freed, &f->mutex);
+    bool stop = f->stop;
+    size_t head = f->head;
+    pthread_mutex_unlock(&f->mutex);
+    if (stop)
+      return NULL;
+
+    // The slot is out of the consumer's reach until head moves past it
+    len_t slot = head % f->nslots;
+    len_t count = f->fill(f->inputs + slot * f->batch * f->nin,
+                          f->targets + slot * f->batch * f->nout, f->batch,
+                          f->ctx);
+    paniciff(count > f->batch, "fill wrote too many rows: %lu > %lu", count,
+             f->batch);
+    f->counts[slot] = count;
+
+    pthread_mutex_lock(&f->mutex);
+    f->head = head + 1;
+    pthread_cond_signal(&f->filled);
+    pthread_mutex_unlock(&f->mutex);
+    if (count == 0)
+      return NULL;
+  }
+}
+
+int feedstart(feed_t *f) {
+  panicif(!f, "feed cannot be null");
+  f->seed = trand();
+  if (pthread_mutex_init(&f->mutex, NULL) != 0)
+    return -1;
+  if (pthread_cond_init(&f->filled, NULL) != 0) {
+    pthread_mutex_destroy(&f->mutex);
+    return -1;
+  }
+  if (pthread_cond_init(&f->freed, NULL) != 0) {
+    pthread_cond_destroy(&f->filled);
+    pthread_mutex_destroy(&f->mutex);
+    return -1;
+  }
+  if (pthread_create(&f->thread, NULL, feedthread, f) != 0) {
+    pthread_cond_destroy(&f->freed);
+    pthread_cond_destroy(&f->filled);
+    pthread_mutex_destroy(&f->mutex);
+    return -1;
+  }
+  return 0;
+}
+
+bool feednext(feed_t *f, const value_t **inputs, const value_t **targets,
+              len_t *count) {
+  panicif(!f, "feed cannot be null");
+
+  pthread_mutex_lock(&f->mutex);
+  if (f->held) {
+    f->tail++;
+    f->held = false;
+    pthread_cond_signal(&f->freed);
+  }
+  while (f->head == f->tail)
+    pthread_cond_wait(&f->filled, &f->mutex);
+  len_t slot = f->tail % f->nslots;
+  pthread_mutex_unlock(&f->mutex);
+
+  // The end marker stays in the ring, so later calls keep returning false
+  if (f->counts[slot] == 0)
+    return false;
+
+  *inputs = f->inputs + slot * f->batch * f->nin;
+  *targets = f->targets + slot * f->batch * f->nout;
+  *count = f->counts[slot];
+  f->held = true;
+  return true;
+}
+
+void feedstop(feed_t *f) {
+  panicif(!f, "feed cannot be null");
+  pthread_mutex_lock(&f->mutex);
+  f->stop = true;
+  pthread_cond_signal(&f->freed);
+  pthread_mutex_unlock(&f->mutex);
+  pthread_join(f->thread, NULL);
+  pthread_cond_destroy(&f->freed);
+  pthread_cond_destroy(&f->filled);
+  pthread_mutex_destroy(&f->mutex);
+}
+#endif
+
+///
+/// CHECKPOINT
+/// ===
+
+// On-disk header of a checkpoint. Followed by the parameters and the extra
+// state.
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t valuesize;
+  uint32_t reserved;
+  uint64_t nparams;
+  uint64_t nextra;
+  uint64_t epoch;
+  uint64_t step;
+} ckptheader_t;
+
+enum { CKPT_VERSION = 1 };
+static const char CKPT_MAGIC[4] = {'G', 'R', 'D', 'C'};
+
+int ckptload(const char *path, const net_t *n, value_t *extra, len_t nextra,
+             uint64_t *epoch, uint64_t *step) {
+  panicif(!path || !n, "must provide path and network");
+  panicif(nextra > 0 && !extra, "must provide extra state");
+  panicif(TAPE.base > 0, "parameters of a segment are read-only");
+
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return -1;
+
+  ckptheader_t h;
+  int ok = fread(&h, sizeof(h), 1, f) == 1 &&
+           memcmp(h.magic, CKPT_MAGIC, sizeof(h.magic)) == 0 &&
+           h.version == CKPT_VERSION && h.valuesize == sizeof(value_t) &&
+           h.nparams == n->params.len && h.nextra == nextra;
+
+  // Validate the length before touching anything, so that a truncated file
+  // leaves the state as it was
+  long start = ftell(f);
+  ok = ok && fseek(f, 0, SEEK_END) == 0 &&
+       (size_t)(ftell(f) - start) ==
+           sizeof(value_t) * (n->params.len + nextra) &&
+       fseek(f, start, SEEK_SET) == 0;
+
+  for (idx_t i = 0; ok && i < n->params.len; i++) {
+    ok = fread(&TAPE.values[n->params.at[i]], sizeof(value_t), 1, f) == 1;
+  }
+  ok = ok && fread(extra, sizeof(value_t), nextra, f) == nextra;
+  fclose(f);
+  if (!ok)
+    return -1;
+
+  if (epoch)
+    *epoch = h.epoch;
+  if (step)
+    *step = h.step;
+  return 0;
+}
+
+#ifdef GRADINO_POSIX
+#include <libgen.h>
+
+#define MAX_ALIGN sizeof(value_t)
+
+size_t ckptsize(const net_t *n, len_t nextra) {
+  panicif(!n, "network cannot be null");
+  return MAX_ALIGN + sizeof(value_t) * (n->params.len + nextra);
+}
+
+// Flush the directory of a path, so that a rename into it survives a crash
+static int syncdir(const char *path) {
+  char dir[4096];
+  int len = snprintf(dir, sizeof(dir), "%s", path);
+  if (len < 0 || (size_t)len >= sizeof(dir))
+    return -1;
+
+  int fd = open(dirname(dir), O_RDONLY);
+  if (fd < 0)
+    return -1;
+  int ok = fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  return ok ? 0 : -1;
+}
+
+// Write the staging buffer to a temporary file, flush it to the device, move
+// it over the previous checkpoint, and flush the move
+static int ckptwrite(ckpt_t *c) {
+  char tmp[4096];
+  int len = snprintf(tmp, sizeof(tmp), "%s.tmp", c->path);
+  if (len < 0 || (size_t)len >= sizeof(tmp))
+    return -1;
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return -1;
+
+  ckptheader_t h;
+  memcpy(h.magic, CKPT_MAGIC, sizeof(h.magic));
+  h.version = CKPT_VERSION;
+  h.valuesize = sizeof(value_t);
+  h.reserved = 0;
+  h.nparams = c->nparams;
+  h.nextra = c->nextra;
+  h.epoch = c->epoch;
+  h.step = c->step;
+
+  const char *chunks[2] = {(const char *)&h, (const char *)c->staging};
+  size_t sizes[2] = {sizeof(h), sizeof(value_t) * (c->nparams + c->nextra)};
+  bool ok = true;
+  for (int i = 0; ok && i < 2; i++) {
+    while (ok && sizes[i] > 0) {
+      ssize_t w = write(fd, chunks[i], sizes[i]);
+      ok = w > 0;
+      if (ok) {
+        chunks[i] += w;
+        sizes[i] -= (size_t)w;
+      }
+    }
+  }
+  ok = fsync(fd) == 0 && ok;
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(tmp, c->path) == 0;
+  if (!ok) {
+    unlink(tmp);
+    return -1;
+  }
+  return syncdir(c->path);
+}
+
+static void *ckptthread(void *arg) {
+  ckpt_t *c = arg;
+  pthread_mutex_lock(&c->mutex);
+  for (;;) {
+    while (!c->pending && !c->stop)
+      pthread_cond_wait(&c->cond, &c->mutex);
+    if (!c->pending)
+      break;
+
+    // The staging buffer is not touched by ckptsave while pending is set,
+    // hence the write can happen outside the lock
+    pthread_mutex_unlock(&c->mutex);
+    int status = ckptwrite(c);
+    pthread_mutex_lock(&c->mutex);
+
+    c->status = status;
+    c->pending = false;
+    pthread_cond_broadcast(&c->cond);
+  }
+  pthread_mutex_unlock(&c->mutex);
+  return NULL;
+}
+
+int ckptinit(ckpt_t *c, const net_t *n, len_t nextra, const char *path,
+             len_t nbuf, char *buffer) {
+  panicif(!c || !n, "checkpoint and network cannot be null");
+  panicif(!path, "must provide path");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < ckptsize(n, nextra),
+           "buffer too small; expected at least %lu, got %lu",
+           ckptsize(n, nextra), nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  uintptr_t addr = (uintptr_t)buffer;
+  uintptr_t aligned = (addr + MAX_ALIGN - 1) & ~(MAX_ALIGN - 1);
+
+  c->staging = (value_t *)aligned;
+  c->nparams = n->params.len;
+  c->nextra = nextra;
+  c->epoch = 0;
+  c->step = 0;
+  c->path = path;
+  c->pending = false;
+  c->stop = false;
+  c->status = 0;
+
+  if (pthread_mutex_init(&c->mutex, NULL) != 0)
+    return -1;
+  if (pthread_cond_init(&c->cond, NULL) != 0) {
+    pthread_mutex_destroy(&c->mutex);
+    return -1;
+  }
+  if (pthread_create(&c->thread, NULL, ckptthread, c) != 0) {
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->mutex);
+    return -1;
+  }
+  return 0;
+}
+
+#undef MAX_ALIGN
+
+bool ckptsave(ckpt_t *c, const net_t *n, const value_t *extra, uint64_t epoch,
+              uint64_t step) {
+  panicif(!c || !n, "checkpoint and network cannot be null");
+  paniciff(n->params.len != c->nparams,
+           "network does not match: expected %lu params, got %lu", c->nparams,
+           n->params.len);
+  panicif(c->nextra > 0 && !extra, "must provide extra state");
+
+  pthread_mutex_lock(&c->mutex);
+  bool busy = c->pending;
+  pthread_mutex_unlock(&c->mutex);
+  if (busy)
+    return false;
+
+  for (idx_t i = 0; i < c->nparams; i++) {
+    c->staging[i] = tval(n->params.at[i]);
+  }
+  if (c->nextra > 0)
+    memcpy(c->staging + c->nparams, extra, sizeof(value_t) * c->nextra);
+  c->epoch = epoch;
+  c->step = step;
+
+  pthread_mutex_lock(&c->mutex);
+  c->pending = true;
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->mutex);
+  return true;
+}
+
+int ckptwait(ckpt_t *c) {
+  panicif(!c, "checkpoint cannot be null");
+  pthread_mutex_lock(&c->mutex);
+  while (c->pending)
+    pthread_cond_wait(&c->cond, &c->mutex);
+  int status = c->status;
+  pthread_mutex_unlock(&c->mutex);
+  return status;
+}
+
+int ckptstop(ckpt_t *c) {
+  panicif(!c, "checkpoint cannot be null");
+  pthread_mutex_lock(&c->mutex);
+  c->stop = true;
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->mutex);
+  pthread_join(c->thread, NULL);
+
+  pthread_cond_destroy(&c->cond);
+  pthread_mutex_destroy(&c->mutex);
+  return c->status;
+}
+#endif
+
+///
+/// PRUNING
+/// ===
+
+#define MAX_ALIGN sizeof(len_t)
+
+size_t prunesize(const net_t *n) {
+  panicif(!n, "network cannot be null");
+  size_t size = MAX_ALIGN;
+  for (idx_t l = 0; l < n->layers.len; l++) {
+    const layer_t *layer = &n->layers.at[l];
+    if (layer->conv.filters == 0 && !layer->rows)
+      size += sizeof(len_t) * (layer->len + 1 + layer->len * layer->nin);
+  }
+  return size;
+}
+
+void pruneinit(net_t *n, len_t nbuf, char *buffer) {
+  panicif(!n, "network cannot be null");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < prunesize(n),
+           "buffer too small; expected at least %lu, got %lu", prunesize(n),
+           nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  uintptr_t addr = (uintptr_t)buffer;
+  uintptr_t aligned = (addr + MAX_ALIGN - 1) & ~(MAX_ALIGN - 1);
+
+  len_t *ptr = (len_t *)aligned;
+  for (idx_t l = 0; l < n->layers.len; l++) {
+    layer_t *layer = &n->layers.at[l];
+    if (layer->conv.filters > 0 || layer->rows)
+      continue;
+
+    layer->rows = ptr;
+    ptr += layer->len + 1;
+    layer->cols = ptr;
+    ptr += layer->len * layer->nin;
+    for (idx_t i = 0; i <= layer->len; i++) {
+      layer->rows[i] = i * layer->nin;
+    }
+    for (idx_t i = 0; i < layer->len * layer->nin; i++) {
+      layer->cols[i] = i % layer->nin;
+    }
+  }
+}
+
+#undef MAX_ALIGN
+
+// Shell sort of the weights of a perceptron along with their positions, by
+// decreasing magnitude or by increasing position
+static void psort(idx_t *w, len_t *cols, len_t len, bool bymagnitude) {
+  for (len_t gap = len / 2; gap > 0; gap /= 2) {
+    for (len_t i = gap; i < len; i++) {
+      idx_t wi = w[i];
+      len_t ci = cols[i];
+      len_t j = i;
+      for (; j >= gap; j -= gap) {
+        bool after = bymagnitude ? fabs(tval(w[j - gap])) < fabs(tval(wi))
+                                 : cols[j - gap] > ci;
+        if (!after)
+          break;
+        w[j] = w[j - gap];
+        cols[j] = cols[j - gap];
+      }
+      w[j] = wi;
+      cols[j] = ci;
+    }
+  }
+}
+
+// Pack the perceptrons of every layer back to back, both in the parameter
+// list and in the sparse rows, after their weights have been cut. Perceptrons
+// only ever shrink, hence the copies never overwrite what is left to move.
+static void netpack(net_t *n) {
+  idx_t *params = n->params.at;
+  for (idx_t l = 0; l < n->layers.len; l++) {
+    layer_t *layer = &n->layers.at[l];
+    len_t *cols = layer->cols;
+    for (idx_t i = 0; i < lnptrons(layer); i++) {
+      ptron_t *p = &layer->at[i];
+      if (layer->rows) {
+        const len_t *from = layer->cols + layer->rows[i];
+        layer->rows[i] = (len_t)(cols - layer->cols);
+        for (idx_t j = 0; j < p->len - 1; j++) {
+          *cols++ = from[j];
+        }
+      }
+      for (idx_t j = 0; j < p->len; j++) {
+        params[j] = p->at[j];
+      }
+      p->at = params;
+      params += p->len;
+    }
+    if (layer->rows)
+      layer->rows[layer->len] = (len_t)(cols - layer->cols);
+  }
+  n->params.len = (len_t)(params - n->params.at);
+}
+
+// Keep the first weights of a perceptron, zeroing the others, and return how
+// many were removed. The bias always stays.
+static len_t pcut(ptron_t *p, len_t keep) {
+  len_t nnz = p->len - 1;
+  for (idx_t j = keep; j < nnz; j++) {
+    TAPE.values[p->at[j]] = 0;
+  }
+  p->at[keep] = p->at[nnz];
+  p->len = keep + 1;
+  return nnz - keep;
+}
+
+len_t netprune(net_t *n, value_t threshold) {
+  panicif(!n, "network cannot be null");
+  panicif(TAPE.base > 0, "parameters of a segment are read-only");
+
+  len_t removed = 0;
+  for (idx_t l = 0; l < n->layers.len; l++) {
+    layer_t *layer = &n->layers.at[l];
+    if (!layer->rows)
+      continue;
+    for (idx_t i = 0; i < layer->len; i++) {
+      ptron_t *p = &layer->at[i];
+      len_t *cols = layer->cols + layer->rows[i];
+      // Move the survivors to the front, in order
+      len_t keep = 0;
+      for (idx_t j = 0; j < p->len - 1; j++) {
+        if (fabs(tval(p->at[j])) < threshold)
+          continue;
+        idx_t w = p->at[keep];
+        p->at[keep] = p->at[j];
+        p->at[j] = w;
+        len_t c = cols[keep];
+        cols[keep] = cols[j];
+        cols[j] = c;
+        keep++;
+      }
+      removed += pcut(p, keep);
+    }
+  }
+  netpack(n);
+  return removed;
+}
+
+len_t netprunetopk(net_t *n, len_t k) {
+  panicif(!n, "network cannot be null");
+  panicif(TAPE.base > 0, "parameters of a segment are read-only");
+
+  len_t removed = 0;
+  for (idx_t l = 0; l < n->layers.len; l++) {
+    layer_t *layer = &n->layers.at[l];
+    if (!layer->rows)
+      continue;
+    for (idx_t i = 0; i < layer->len; i++) {
+      ptron_t *p = &layer->at[i];
+      len_t *cols = layer->cols + layer->rows[i];
+      len_t nnz = p->len - 1;
+      if (nnz <= k)
+        continue;
+      psort(p->at, cols, nnz, true);
+      // Inputs are read in order again, which is kinder to the cache
+      psort(p->at, cols, k, false);
+      removed += pcut(p, k);
+    }
+  }
+  netpack(n);
+  return removed;
+}
+
+///
+/// ARENA
+/// ===
+
+#define CACHE_LINE 64
+
+static size_t lineup(size_t size) {
+  return (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+}
+
+// Records one forward pass may need: every layer reserves the bound of all its
+// activations before recording them
+static len_t fwdrecords(const arena_t *a) {
+  len_t records = 0;
+  for (len_t i = 1; i < a->nlens; i++) {
+    const conv_t *c = a->convs && a->convs[i - 1].filters > 0 ? &a->convs[i - 1]
+                                                              : NULL;
+    len_t nin = c ? c->kernel * c->kernel * c->channels : a->llens[i - 1];
+    records += a->llens[i] * PRECORDS(nin);
+  }
+  return records;
+}
+
+len_t arenarecords(const arena_t *a) {
+  panicif(!a, "arena cannot be null");
+  len_t nptrons, nparams, nscratch, npatch;
+  netcount(a->nlens, a->llens, a->convs, &nptrons, &nparams, &nscratch,
+           &npatch);
+
+  len_t fwd = fwdrecords(a);
+  len_t step = max(a->samples, 1) * (fwd + a->records);
+  if (a->fit > 0) {
+    len_t nout = a->llens[a->nlens - 1];
+    step = max(fwd + fitrecords(a->llens[0], nout), step);
+  }
+  // Parameters and the zero interned by netinit, then the user's constants
+  return nparams + 1 + a->consts + step;
+}
+
+// Byte sizes of the regions of an arena, in layout order
+enum { REGION_TAPE, REGION_NET, REGION_ACC, REGION_FIT, REGION_INFER, NREGIONS };
+
+// Same as infersize, from the layer sizes
+static size_t arenainfer(const arena_t *a, len_t width, len_t count) {
+  len_t nweights = width + 1;
+  len_t ncols = 0;
+  for (len_t i = 1; i < a->nlens; i++) {
+    const conv_t *c =
+        a->convs && a->convs[i - 1].filters > 0 ? &a->convs[i - 1] : NULL;
+    if (!c)
+      continue;
+    len_t field = c->kernel * c->kernel * c->channels;
+    nweights = max(c->filters * (field + 1), nweights);
+    ncols = max(convpositions(c) * field, ncols);
+  }
+  return inferbytes(width, nweights, ncols, count);
+}
+
+static void arenaregions(const arena_t *a, size_t sizes[NREGIONS]) {
+  len_t nptrons, nparams, nscratch, npatch;
+  netcount(a->nlens, a->llens, a->convs, &nptrons, &nparams, &nscratch,
+           &npatch);
+  len_t nin = a->llens[0];
+  len_t nout = a->llens[a->nlens - 1];
+
+  sizes[REGION_TAPE] = tapesize(arenarecords(a));
+  sizes[REGION_NET] = netsizeconv(a->nlens, a->llens, a->convs);
+  sizes[REGION_ACC] = a->acc ? accbytes(nparams) : 0;
+  sizes[REGION_FIT] =
+      a->fit > 0 ? fitbytes(accbytes(nparams), arenainfer(a, nscratch, 1),
+                            nparams, a->fit, nin, nout)
+                 : 0;
+  sizes[REGION_INFER] =
+      a->infer > 0 ? arenainfer(a, nscratch, a->infer) : 0;
+}
+
+size_t arenasize(const arena_t *a) {
+  panicif(!a, "arena cannot be null");
+  size_t sizes[NREGIONS];
+  arenaregions(a, sizes);
+  size_t size = CACHE_LINE;
+  for (int i = 0; i < NREGIONS; i++) {
+    size += lineup(sizes[i]);
+  }
+  return size;
+}
+
+void arenainit(arena_t *a, len_t nbuf, char *buffer) {
+  panicif(!a, "arena cannot be null");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < arenasize(a),
+           "buffer too small; expected at least %lu, got %lu", arenasize(a),
+           nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  size_t sizes[NREGIONS];
+  arenaregions(a, sizes);
+
+  uintptr_t addr = (uintptr_t)buffer;
+  char *ptr = buffer + (lineup(addr) - addr);
+  char *regions[NREGIONS];
+  for (int i = 0; i < NREGIONS; i++) {
+    regions[i] = ptr;
+    ptr += lineup(sizes[i]);
+  }
+
+  // The network records its parameters, so the tape comes first
+  tapeinit(arenarecords(a), (len_t)sizes[REGION_TAPE], regions[REGION_TAPE]);
+  netinitconv(&a->net, a->nlens, a->llens, a->convs,
+              (len_t)sizes[REGION_NET], regions[REGION_NET]);
+
+  a->accum = (acc_t){0};
+  if (a->acc)
+    accinit(&a->accum, &a->net, (len_t)sizes[REGION_ACC], regions[REGION_ACC]);
+
+  a->fitbuf = a->fit > 0 ? regions[REGION_FIT] : NULL;
+  a->nfitbuf = (len_t)sizes[REGION_FIT];
+  a->inferbuf = a->infer > 0 ? regions[REGION_INFER] : NULL;
+  a->ninferbuf = (len_t)sizes[REGION_INFER];
+}
+
+void *arenacreate(arena_t *a) {
+  len_t nbuf = arenasize(a);
+  char *buffer = GRADINO_ALLOC(nbuf);
+  if (!buffer)
+    return NULL;
+  arenainit(a, nbuf, buffer);
+  return buffer;
+}
+
+#undef CACHE_LINE
+
+///
+/// SECOND ORDER
+/// ===
+
+#define MAX_ALIGN sizeof(value_t)
+
+// Input and result indices of a full-batch pass, placed after the values of a
+// buffer
+static void fullinit(const net_t *n, vec_t *input, vec_t *result, idx_t *at) {
+  len_t nin = n->layers.at[0].nin;
+  vecinit(input, nin, at);
+  vecinit(result, n->layers.at[n->layers.len - 1].len, at + nin);
+}
+
+static size_t fullbytes(const net_t *n, len_t nvalues) {
+  len_t nin = n->layers.at[0].nin;
+  len_t nout = n->layers.at[n->layers.len - 1].len;
+  return MAX_ALIGN + sizeof(value_t) * nvalues + sizeof(idx_t) * (nin + nout);
+}
+
+// Return the mean loss over every sample, and its gradient into grad
+static value_t fullgrad(net_t *n, const fit_t *f, vec_t *input,
+                        vec_t *result, idx_t mark, value_t *grad) {
+  len_t nout = result->len;
+  for (idx_t j = 0; j < n->params.len; j++) {
+    grad[j] = 0;
+  }
+
+  value_t sum = 0;
+  for (idx_t s = 0; s < f->nsamples; s++) {
+    tapereset(mark);
+    for (idx_t i = 0; i < input->len; i++) {
+      input->at[i] = vfrom(f->inputs[s * input->len + i]);
+    }
+    netfwd(n, input, result);
+    idx_t loss = fitloss(f->loss, result, f->targets + s * nout);
+    sum += tapeval(loss);
+
+    tapezerograd();
+    tapebackprop(loss);
+    for (idx_t j = 0; j < n->params.len; j++) {
+      grad[j] += TAPE.grads[n->params.at[j]];
+    }
+  }
+
+  value_t scale = 1.0 / (value_t)f->nsamples;
+  for (idx_t j = 0; j < n->params.len; j++) {
+    grad[j] *= scale;
+  }
+  return sum * scale;
+}
+
+static void paramsget(const net_t *n, value_t *x) {
+  for (idx_t j = 0; j < n->params.len; j++) {
+    x[j] = TAPE.values[n->params.at[j]];
+  }
+}
+
+// Set the parameters to x + t * d, or to x when d is NULL
+static void paramsset(const net_t *n, const value_t *x, value_t t,
+                      const value_t *d) {
+  for (idx_t j = 0; j < n->params.len; j++) {
+    TAPE.values[n->params.at[j]] = d ? x[j] + t * d[j] : x[j];
+  }
+}
+
+static value_t dot(const value_t *a, const value_t *b, len_t len) {
+  value_t sum = 0;
+  for (idx_t i = 0; i < len; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+static void fullcheck(const net_t *n, const fit_t *f) {
+  panicif(!n || !f, "network and configuration cannot be null");
+  panicif(!f->inputs || !f->targets, "must provide inputs and targets");
+  panicif(f->nsamples == 0, "must provide samples");
+  panicif(TAPE.base > 0, "parameters of a segment are read-only");
+  (void)n, (void)f; // silence unused warning for release builds
+}
+
+size_t hvpsize(const net_t *n) {
+  panicif(!n, "network cannot be null");
+  // parameters, and the gradient at one side
+  return fullbytes(n, 2 * n->params.len);
+}
+
+void nethvp(net_t *n, const fit_t *f, const value_t *v, value_t *hv,
+            len_t nbuf, char *buffer) {
+  fullcheck(n, f);
+  panicif(!v || !hv, "vectors cannot be null");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < hvpsize(n), "buffer too small; expected at least %lu, got %lu",
+           hvpsize(n), nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  uintptr_t addr = (uintptr_t)buffer;
+  uintptr_t aligned = (addr + MAX_ALIGN - 1) & ~(MAX_ALIGN - 1);
+
+  len_t np = n->params.len;
+  value_t *x = (value_t *)aligned;
+  value_t *minus = x + np;
+  vec_t input, result;
+  fullinit(n, &input, &result, (idx_t *)(minus + np));
+
+  vconst(0);
+  idx_t mark = tapemark();
+  paramsget(n, x);
+
+  // The step balances truncation and rounding errors of a central difference
+  value_t vnorm = sqrt(dot(v, v, np));
+  if (!(vnorm > 0)) {
+    for (idx_t j = 0; j < np; j++) {
+      hv[j] = 0;
+    }
+    return;
+  }
+  value_t eps = cbrt(DBL_EPSILON) * (1.0 + sqrt(dot(x, x, np))) / vnorm;
+
+  paramsset(n, x, eps, v);
+  fullgrad(n, f, &input, &result, mark, hv);
+  paramsset(n, x, -eps, v);
+  fullgrad(n, f, &input, &result, mark, minus);
+  paramsset(n, x, 0, NULL);
+  tapereset(mark);
+
+  for (idx_t j = 0; j < np; j++) {
+    hv[j] = (hv[j] - minus[j]) / (2 * eps);
+  }
+}
+
+size_t lbfgssize(const net_t *n, len_t history) {
+  panicif(!n, "network cannot be null");
+  // parameters, gradients and direction, steps and gradient changes, and
+  // their curvatures and coefficients
+  return fullbytes(n, 4 * n->params.len + 2 * history * n->params.len +
+                          2 * history);
+}
+
+// Sufficient decrease of the Armijo condition, and maximum number of halvings
+// of a step
+#define ARMIJO 1e-4
+#define MAX_HALVINGS 40
+
+value_t netlbfgs(net_t *n, const fit_t *f, len_t history, len_t nbuf,
+                 char *buffer) {
+  fullcheck(n, f);
+  panicif(history == 0, "history must be positive");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < lbfgssize(n, history),
+           "buffer too small; expected at least %lu, got %lu",
+           lbfgssize(n, history), nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  uintptr_t addr = (uintptr_t)buffer;
+  uintptr_t aligned = (addr + MAX_ALIGN - 1) & ~(MAX_ALIGN - 1);
+
+  len_t np = n->params.len;
+  value_t *x = (value_t *)aligned; // parameters before the step
+  value_t *g = x + np;
+  value_t *g0 = g + np; // gradient before the step
+  value_t *d = g0 + np;
+  value_t *steps = d + np;           // history rows of parameter changes
+  value_t *diffs = steps + history * np; // history rows of gradient changes
+  value_t *rho = diffs + history * np;
+  value_t *alpha = rho + history;
+  vec_t input, result;
+  fullinit(n, &input, &result, (idx_t *)(alpha + history));
+
+  vconst(0);
+  idx_t mark = tapemark();
+  value_t loss = fullgrad(n, f, &input, &result, mark, g);
+
+  // Rows of the history form a ring, the newest at (first + count - 1)
+  len_t first = 0;
+  len_t count = 0;
+  for (len_t iter = 0; iter < f->epochs; iter++) {
+    // Two-loop recursion: d = -H * g
+    for (idx_t j = 0; j < np; j++) {
+      d[j] = -g[j];
+    }
+    for (len_t k = count; k-- > 0;) {
+      len_t row = (first + k) % history;
+      alpha[row] = rho[row] * dot(steps + row * np, d, np);
+      for (idx_t j = 0; j < np; j++) {
+        d[j] -= alpha[row] * diffs[row * np + j];
+      }
+    }
+    // Scale by the curvature of the newest step, or take a unit step along
+    // the gradient direction when there is none yet
+    value_t gamma = 1.0 / (1.0 + sqrt(dot(g, g, np)));
+    if (count > 0) {
+      len_t row = (first + count - 1) % history;
+      value_t *y = diffs + row * np;
+      gamma = 1.0 / (rho[row] * dot(y, y, np));
+    }
+    for (idx_t j = 0; j < np; j++) {
+      d[j] *= gamma;
+    }
+    for (len_t k = 0; k < count; k++) {
+      len_t row = (first + k) % history;
+      value_t beta = rho[row] * dot(diffs + row * np, d, np);
+      for (idx_t j = 0; j < np; j++) {
+        d[j] += steps[row * np + j] * (alpha[row] - beta);
+      }
+    }
+
+    value_t slope = dot(g, d, np);
+    if (slope >= 0) {
+      // Not a descent direction: drop the history and follow the gradient
+      for (idx_t j = 0; j < np; j++) {
+        d[j] = -g[j] * gamma;
+      }
+      slope = dot(g, d, np);
+      count = 0;
+    }
+
+    // Backtrack until the loss decreases enough
+    paramsget(n, x);
+    for (idx_t j = 0; j < np; j++) {
+      g0[j] = g[j];
+    }
+    value_t loss0 = loss;
+    value_t t = 1;
+    int halvings = 0;
+    for (; halvings < MAX_HALVINGS; halvings++, t *= 0.5) {
+      paramsset(n, x, t, d);
+      loss = fullgrad(n, f, &input, &result, mark, g);
+      if (loss <= loss0 + ARMIJO * t * slope)
+        break;
+    }
+    if (halvings == MAX_HALVINGS) {
+      paramsset(n, x, 0, NULL);
+      loss = loss0;
+      break;
+    }
+
+    // Remember the step, unless its curvature would break positive
+    // definiteness
+    len_t row = (first + count) % history;
+    value_t *s = steps + row * np;
+    value_t *y = diffs + row * np;
+    for (idx_t j = 0; j < np; j++) {
+      s[j] = t * d[j];
+      y[j] = g[j] - g0[j];
+    }
+    value_t sy = dot(s, y, np);
+    if (count == history) {
+      // The oldest row was overwritten
+      first = (first + 1) % history;
+      count--;
+    }
+    if (sy > DBL_EPSILON * dot(y, y, np)) {
+      rho[row] = 1.0 / sy;
+      count++;
+    }
+
+    if (f->onepoch && !f->onepoch(iter, loss, f->ctx))
+      break;
+  }
+
+  tapereset(mark);
+  return loss;
+}
+
+#undef MAX_HALVINGS
+#undef ARMIJO
+#undef MAX_ALIGN
+
+///
+/// STREAM
+/// ===
+
+#define MAX_ALIGN sizeof(value_t)
+
+size_t streamsize(const net_t *n, len_t window) {
+  panicif(!n, "network cannot be null");
+  len_t nin = n->layers.at[0].nin;
+  len_t nout = n->layers.at[n->layers.len - 1].len;
+  // raw row and ring of losses, then input and result indices
+  return MAX_ALIGN + sizeof(value_t) * (nin + nout + window) +
+         sizeof(idx_t) * (nin + nout);
+}
+
+void streaminit(stream_t *s, const net_t *n, double rate, loss_t loss,
+                len_t window, len_t nbuf, char *buffer) {
+  panicif(!s || !n, "stream and network cannot be null");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < streamsize(n, window),
+           "buffer too small; expected at least %lu, got %lu",
+           streamsize(n, window), nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  uintptr_t addr = (uintptr_t)buffer;
+  uintptr_t aligned = (addr + MAX_ALIGN - 1) & ~(MAX_ALIGN - 1);
+
+  len_t nin = n->layers.at[0].nin;
+  len_t nout = n->layers.at[n->layers.len - 1].len;
+  s->x = (value_t *)aligned;
+  s->y = s->x + nin;
+  s->losses = s->y + nout;
+  idx_t *at = (idx_t *)(s->losses + window);
+  vecinit(&s->input, nin, at);
+  vecinit(&s->result, nout, at + nin);
+
+  s->rate = rate;
+  s->loss = loss;
+  s->window = window;
+  s->count = 0;
+  s->sum = 0;
+  s->sumsq = 0;
+
+  // The zero of fitloss must live below the mark
+  vconst(0);
+  s->mark = tapemark();
+}
+
+value_t streamstep(stream_t *s, net_t *n, const value_t *input,
+                   const value_t *target) {
+  panicif(!s || !n, "stream and network cannot be null");
+  panicif(!input || !target, "must provide input and target");
+
+  tapereset(s->mark);
+  for (idx_t i = 0; i < s->input.len; i++) {
+    s->input.at[i] = vfrom(input[i]);
+  }
+  netfwd(n, &s->input, &s->result);
+  idx_t idx = fitloss(s->loss, &s->result, target);
+  value_t loss = tapeval(idx);
+
+  tapezerograd();
+  tapebackprop(idx);
+  netgdstep(n, s->rate);
+
+  if (s->window > 0) {
+    len_t slot = (len_t)(s->count % s->window);
+    if (s->count >= s->window) {
+      value_t old = s->losses[slot];
+      s->sum -= old;
+      s->sumsq -= old * old;
+    }
+    s->losses[slot] = loss;
+    s->sum += loss;
+    s->sumsq += loss * loss;
+
+    // Sums updated in place drift over millions of samples: recompute them
+    // from the ring whenever it wraps around
+    if (slot == s->window - 1) {
+      s->sum = 0;
+      s->sumsq = 0;
+      for (idx_t i = 0; i < s->window; i++) {
+        s->sum += s->losses[i];
+        s->sumsq += s->losses[i] * s->losses[i];
+      }
+    }
+  }
+  s->count++;
+  return loss;
+}
+
+uint64_t netstream(stream_t *s, net_t *n, streamread_t read, void *ctx) {
+  panicif(!s || !n, "stream and network cannot be null");
+  panicif(!read, "must provide a reader");
+  uint64_t count = 0;
+  while (read(s->x, s->y, ctx)) {
+    streamstep(s, n, s->x, s->y);
+    count++;
+  }
+  return count;
+}
+
+void streamstats(const stream_t *s, value_t *mean, value_t *dev) {
+  panicif(!s || !mean || !dev, "stream and results cannot be null");
+  len_t count = s->count < s->window ? (len_t)s->count : s->window;
+  if (count == 0) {
+    *mean = 0;
+    *dev = 0;
+    return;
+  }
+  *mean = s->sum / (value_t)count;
+  value_t var = s->sumsq / (value_t)count - *mean * *mean;
+  *dev = var > 0 ? sqrt(var) : 0;
+}
+
+#ifdef GRADINO_POSIX
+#include <errno.h>
+
+// Read exactly n bytes. Returns false on errors or end of file.
+static bool fdreadall(int fd, void *buf, size_t n) {
+  char *p = buf;
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= (size_t)r;
+  }
+  return true;
+}
+
+uint64_t netstreamfd(stream_t *s, net_t *n, int fd) {
+  panicif(!s || !n, "stream and network cannot be null");
+  // Inputs and targets are adjacent in the buffer
+  size_t row = sizeof(value_t) * (s->input.len + s->result.len);
+  uint64_t count = 0;
+  while (fdreadall(fd, s->x, row)) {
+    streamstep(s, n, s->x, s->y);
+    count++;
+  }
+  return count;
+}
+#endif
+
+#undef MAX_ALIGN
+
+///
+/// ENSEMBLE
+/// ===
+
+union ensemblealign {
+  elayer_t l;
+  value_t v;
+  len_t n;
+};
+
+#define MAX_ALIGN sizeof(union ensemblealign)
+
+size_t ensemblesize(len_t nmodels, len_t nlens, len_t *llens) {
+  panicif(nlens < 2 || !llens, "layers must be defined and not empty");
+  len_t nvalues = 0;
+  for (len_t i = 1; i < nlens; i++) {
+    // weights and biases, and the activations
+    nvalues += ((llens[i - 1] + 1) * llens[i] + llens[i]) * nmodels;
+  }
+  return MAX_ALIGN + sizeof(elayer_t) * (nlens - 1) +
+         sizeof(value_t) * nvalues + sizeof(len_t) * llens[nlens - 1];
+}
+
+void ensembleinit(ensemble_t *e, len_t nmodels, len_t nlens, len_t *llens,
+                  len_t nbuf, char *buffer) {
+  panicif(!e, "ensemble cannot be null");
+  panicif(nmodels == 0, "ensemble must have models");
+  panicif(!buffer, "must provide buffer");
+  paniciff(nbuf < ensemblesize(nmodels, nlens, llens),
+           "buffer too small; expected at least %lu, got %lu",
+           ensemblesize(nmodels, nlens, llens), nbuf);
+  (void)nbuf; // silence unused warning for release builds
+
+  uintptr_t addr = (uintptr_t)buffer;
+  uintptr_t aligned = (addr + MAX_ALIGN - 1) & ~(MAX_ALIGN - 1);
+
+  void *ptr = (void *)aligned;
+  e->layers.len = nlens - 1;
+  e->layers.at = ptr;
+  e->nmodels = nmodels;
+  ptr = (elayer_t *)ptr + e->layers.len;
+
+  value_t *values = ptr;
+  for (len_t i = 0; i < e->layers.len; i++) {
+    elayer_t *l = &e->layers.at[i];
+    l->nin = llens[i];
+    l->nout = llens[i + 1];
+    panicif(l->nin == 0 || l->nout == 0, "layer sizes must be positive");
+
+    l->w = values;
+    values += (l->nin + 1) * l->nout * nmodels;
+    l->out = values;
+    values += l->nout * nmodels;
+    for (value_t *v = l->w; v < values; v++) {
+      *v = 0;
+    }
+  }
+  e->votes = (len_t *)values;
+}
+
+ensemble_t *ensemblecreate(len_t nmodels, len_t nlens, len_t *llens) {
+  len_t nbuf = ensemblesize(nmodels, nlens, llens);
+  void *buffer = GRADINO_ALLOC(sizeof(ensemble_t) + nbuf);
+  if (!buffer)
+    return NULL;
+  ensemble_t *e = buffer;
+  ensembleinit(e, nmodels, nlens, llens, nbuf, (char *)buffer + sizeof(ensemble_t));
+  return e;
+}
+
+#undef MAX_ALIGN
+
+void ensembleset(ensemble_t *e, len_t model, const net_t *n) {
+  panicif(!e || !n, "ensemble and network cannot be null");
+  paniciff(model >= e->nmodels, "expected model in [0, %lu), got %lu",
+           e->nmodels, model);
+  panicif(n->layers.len != e->layers.len, "network must have the same shape");
+
+  len_t nmodels = e->nmodels;
+  for (idx_t i = 0; i < e->layers.len; i++) {
+    const layer_t *src = &n->layers.at[i];
+    elayer_t *dst = &e->layers.at[i];
+    panicif(src->nin != dst->nin || src->len != dst->nout,
+            "network must have the same shape");
+    panicif(src->conv.filters > 0 || src->rows,
+            "network must be fully connected and not pruned");
+    for (idx_t j = 0; j < dst->nout; j++) {
+      const ptron_t *p = &src->at[j];
+      value_t *w = dst->w + j * (dst->nin + 1) * nmodels + model;
+      for (idx_t k = 0; k <= dst->nin; k++) {
+        w[k * nmodels] = tval(p->at[k]);
+      }
+    }
+  }
+}
+
+void ensemblefwd(ensemble_t *e, const value_t *input, reduce_t reduce,
+                 value_t *result) {
+  panicif(!e, "ensemble cannot be null");
+  panicif(!input || !result, "must provide input and result");
+
+  len_t nmodels = e->nmodels;
+  const value_t *in = NULL;
+  for (idx_t i = 0; i < e->layers.len; i++) {
+    const elayer_t *l = &e->layers.at[i];
+    for (idx_t j = 0; j < l->nout; j++) {
+      const value_t *w = l->w + j * (l->nin + 1) * nmodels;
+      value_t *out = l->out + j * nmodels;
+      const value_t *bias = w + l->nin * nmodels;
+      for (idx_t m = 0; m < nmodels; m++) {
+        out[m] = bias[m];
+      }
+      // Each sweep adds one weight of every model: the loops over models
+      // are contiguous and vectorize
+      for (idx_t k = 0; k < l->nin; k++) {
+        const value_t *wk = w + k * nmodels;
+        if (!in) {
+          // The input of the first layer is the same for every model
+          value_t x = input[k];
+          for (idx_t m = 0; m < nmodels; m++) {
+            out[m] += wk[m] * x;
+          }
+        } else {
+          const value_t *x = in + k * nmodels;
+          for (idx_t m = 0; m < nmodels; m++) {
+            out[m] += wk[m] * x[m];
+          }
+        }
+      }
+      for (idx_t m = 0; m < nmodels; m++) {
+        out[m] = tanh(out[m]);
+      }
+    }
+    in = l->out;
+  }
+
+  const elayer_t *last = &e->layers.at[e->layers.len - 1];
+  switch (reduce) {
+  case REDUCE_MEAN:
+    for (idx_t j = 0; j < last->nout; j++) {
+      value_t sum = 0;
+      for (idx_t m = 0; m < nmodels; m++) {
+        sum += last->out[j * nmodels + m];
+      }
+      result[j] = sum / (value_t)nmodels;
+    }
+    break;
+  case REDUCE_VOTE:
+    for (idx_t j = 0; j < last->nout; j++) {
+      e->votes[j] = 0;
+    }
+    for (idx_t m = 0; m < nmodels; m++) {
+      idx_t best = 0;
+      for (idx_t j = 1; j < last->nout; j++) {
+        if (last->out[j * nmodels + m] > last->out[best * nmodels + m])
+          best = j;
+      }
+      e->votes[best]++;
+    }
+    for (idx_t j = 0; j < last->nout; j++) {
+      result[j] = (value_t)e->votes[j] / (value_t)nmodels;
+    }
+    break;
+  default:
+    unreacheable();
+    break;
+  }
+}
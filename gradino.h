@@ -1,7 +1,19 @@
 #pragma once
+// Threads and clocks are declared only when POSIX is requested before the
+// first system header
+#if defined(GRADINO_POSIX) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+// perf_event_open has no libc wrapper, and syscall is only declared with the
+// default feature set on top of POSIX
+#if defined(GRADINO_PERF) && defined(GRADINO_POSIX) && defined(__linux__) &&   \
+    !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -23,6 +35,38 @@
 #define GRADINO_FREE free
 #endif
 
+// Define GRADINO_POSIX when compiling gradino.c to enable the parts of the
+// library that depend on POSIX, such as multi-threading. Link with pthreads.
+
+// Define GRADINO_PERF along with GRADINO_POSIX when compiling gradino.c to
+// count hardware events in the main phases of the library on Linux. See PERF.
+
+// Define GRADINO_INLINE everywhere, gradino.c included, to define the hot path
+// (tapeval, tapegrad, tapemark, vfrom, vadd, vsub, vmul, vtanh) as static
+// inline functions in this header, so that they can be inlined in your loops.
+#ifdef GRADINO_INLINE
+#define GRADINO_HOT static inline
+#else
+#define GRADINO_HOT
+#endif
+
+// Define GRADINO_IMPLEMENTATION in exactly one file before including this
+// header to compile the library in that file, in place of gradino.c. Combined
+// with GRADINO_INLINE, a program made of that single file sees the whole
+// library at once:
+//
+//   #define GRADINO_INLINE
+//   #define GRADINO_IMPLEMENTATION
+//   #include "gradino.h"
+#ifdef GRADINO_IMPLEMENTATION
+#define GRADINO_SOURCE
+#endif
+
+// Maximum number of constants interned by vconst.
+#ifndef GRADINO_NCONSTS
+#define GRADINO_NCONSTS 8
+#endif
+
 // The type of the underlying scalars used in the network.
 typedef double value_t;
 
@@ -33,6 +77,9 @@ typedef unsigned long idx_t;
 // Represents lengths (for slices and buffers) in the same type as idx_t.
 typedef idx_t len_t;
 
+// Index of a value that is no longer on the tape. See tapecompact.
+#define IDX_NONE ((idx_t)-1)
+
 ///
 /// STRUCTURES
 /// ===
@@ -47,6 +94,15 @@ typedef idx_t len_t;
 // A contiguous view of value indices.
 typedef Slice(idx_t) vec_t;
 
+// A nonzero entry of a sparse vector: its position and value.
+typedef struct {
+  len_t pos;
+  idx_t val;
+} sparse_t;
+
+// A sparse vector, as the list of its nonzero entries.
+typedef Slice(sparse_t) svec_t;
+
 // Operation kinds recorded on the tape.
 typedef enum {
   OP_CONST,
@@ -63,28 +119,360 @@ typedef struct {
   idx_t output;
 } op_t;
 
+// A constant interned by vconst.
+typedef struct {
+  value_t value;
+  idx_t idx;
+} interned_t;
+
 // Global tape holding values, gradients, and operations.
 typedef struct {
+  // Records from base on. Values below base belong to a shared segment.
   value_t *values;
   value_t *grads;
   op_t *ops;
+  const value_t *shared;
+  idx_t base;
   len_t len;
   len_t cap;
+  // Constants interned by vconst, sorted by index.
+  interned_t consts[GRADINO_NCONSTS];
+  len_t nconsts;
+  // State of the random number generator.
+  uint64_t rng[4];
 } tape_t;
 
+// Read-only bottom of a tape, shared by the tapes of other threads.
+typedef struct {
+  const value_t *values;
+  len_t len;
+  interned_t consts[GRADINO_NCONSTS];
+  len_t nconsts;
+} seg_t;
+
+// Dual number: a value and its tangent, for forward-mode autodiff.
+typedef struct {
+  value_t val;
+  value_t tan;
+} dual_t;
+
+// A contiguous view of dual numbers.
+typedef Slice(dual_t) dvec_t;
+
+// Backpropagation schedule: the records reachable from a root grouped by
+// dependency level, with the users of every record in compressed rows.
+typedef struct {
+  idx_t root;
+  len_t nlevels;
+  len_t *levels; // level l is order[levels[l]..levels[l + 1]]
+  idx_t *order;
+  len_t *offsets; // users of order[k] are users[offsets[k]..offsets[k + 1]]
+  idx_t *users;   // user index * 2 + input slot
+} sched_t;
+
+// Threads running schedbackprop, parked between calls. Defined with
+// GRADINO_POSIX only.
+typedef struct schedpool schedpool_t;
+
+// Parameter initialization schemes.
+typedef enum {
+  INIT_UNIFORM, // weights and biases in [-1, 1]
+  INIT_XAVIER,  // weights in ±sqrt(6 / (fan_in + fan_out)), zero biases
+  INIT_HE,      // weights in ±sqrt(6 / fan_in), zero biases
+} init_t;
+
 // Perceptron: slice of parameter indices (weights + bias).
 typedef vec_t ptron_t;
 
-// Layer: a slice of perceptrons.
-typedef Slice(ptron_t) layer_t;
+// Geometry of a convolutional layer. Inputs are height x width grids of
+// channels values, stored position by position. Square filters slide over the
+// grid with the given stride, without padding. Outputs use the same layout,
+// with one channel per filter.
+typedef struct {
+  len_t height;
+  len_t width;
+  len_t channels;
+  len_t kernel;  // side of the filters
+  len_t filters; // 0 for a fully connected layer
+  len_t stride;
+} conv_t;
+
+// Layer: a slice of perceptrons, one per output. Convolutional layers have
+// one perceptron per filter instead, shared by every output position.
+typedef struct {
+  len_t len; // number of outputs
+  ptron_t *at;
+  len_t nin; // number of inputs
+  conv_t conv;
+  // Pruned layers are stored in compressed sparse rows: the weights of
+  // perceptron i read the inputs at cols[rows[i]..rows[i + 1]]. NULL when
+  // the layer is not pruned.
+  len_t *rows;
+  len_t *cols;
+} layer_t;
 
 // Network: a slice of layers.
 typedef struct {
   Slice(layer_t) layers;
   vec_t params;
   vec_t scratch;
+  dvec_t dual;
+  vec_t patch; // receptive field of a convolution output
 } net_t;
 
+// Loss functions for netfit.
+typedef enum {
+  LOSS_SQUARED, // sum of squared errors over the outputs
+  LOSS_MEAN,    // mean of squared errors over the outputs
+} loss_t;
+
+// Learning rate decays for netfit, applied after the warmup.
+typedef enum {
+  DECAY_NONE,   // constant rate
+  DECAY_STEP,   // multiply by decayrate every decayevery epochs
+  DECAY_COSINE, // follow half a cosine down to zero at the last epoch
+} decay_t;
+
+// Training configuration for netfit.
+typedef struct {
+  const value_t *inputs;  // nsamples rows of llens[0] values
+  const value_t *targets; // nsamples rows of llens[nlens-1] values
+  len_t nsamples;
+  len_t epochs;
+  len_t batch; // samples per step, 1 for stochastic gradient descend
+  double rate;
+  loss_t loss;
+  bool shuffle; // visit the samples in a new random order every epoch
+  // Learning rate schedule, see fitrate. Optional.
+  decay_t decay;
+  len_t warmup;     // epochs ramping the rate up linearly to rate
+  len_t decayevery; // epochs between two DECAY_STEP decays
+  double decayrate; // factor of every DECAY_STEP decay
+  // Early stopping on a validation split. Its loss is evaluated after every
+  // epoch without recording, and training stops after patience epochs without
+  // improvement, zero meaning never. The best parameters are then restored.
+  // Optional.
+  const value_t *vinputs;
+  const value_t *vtargets;
+  len_t nvalid;
+  len_t patience;
+  // Called after every epoch with the mean loss per sample. Return false to
+  // stop training. Optional.
+  bool (*onepoch)(len_t epoch, value_t loss, void *ctx);
+  void *ctx;
+} fit_t;
+
+// Dataset of input and target rows, memory-mapped from a file.
+typedef struct {
+  const value_t *inputs;  // nrows rows of nin values
+  const value_t *targets; // nrows rows of nout values
+  len_t nrows;
+  len_t nin;
+  len_t nout;
+  void *map;
+  size_t mapsize;
+} data_t;
+
+// Iterator over the rows of a dataset, by blocks of consecutive rows.
+typedef struct {
+  const data_t *data;
+  idx_t *order; // block visiting order
+  len_t nblocks;
+  len_t block;
+  idx_t cursor;
+  bool shuffle;
+} dataiter_t;
+
+#ifdef GRADINO_POSIX
+#include <pthread.h>
+
+enum { SCHED_MAX_THREADS = 64 };
+
+typedef struct {
+  schedpool_t *pool;
+  len_t id;
+} schedworker_t;
+
+// The calling thread of schedbackprop works as thread 0, alongside nthreads - 1
+// spawned ones. The barrier is hand-rolled as pthread_barrier_t is an optional
+// part of POSIX.
+struct schedpool {
+  pthread_t threads[SCHED_MAX_THREADS];
+  schedworker_t workers[SCHED_MAX_THREADS];
+  len_t nthreads;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // Current call, published by bumping job
+  const sched_t *sched;
+  const tape_t *tape;
+  uint64_t job;
+  bool stop;
+  // Barrier
+  len_t waiting;
+  uint64_t generation;
+};
+
+// Fill up to count rows of inputs and targets, returning the number of rows
+// written. Returning 0 signals the end of the data.
+typedef len_t (*feedfill_t)(value_t *inputs, value_t *targets, len_t count,
+                            void *ctx);
+
+// Ring of minibatches filled by a background thread. The producer only
+// advances head and the consumer only advances tail, both under the mutex.
+typedef struct {
+  value_t *inputs;  // nslots * batch rows of nin values
+  value_t *targets; // nslots * batch rows of nout values
+  len_t *counts;    // rows per slot, 0 marks the end
+  len_t nslots;
+  len_t batch;
+  len_t nin;
+  len_t nout;
+  feedfill_t fill;
+  void *ctx;
+  uint64_t seed;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t filled; // head moved
+  pthread_cond_t freed;  // tail moved, or stop was set
+  size_t head;           // slots filled
+  size_t tail;           // slots released
+  bool held;
+  bool stop;
+} feed_t;
+
+// Checkpoint writer: a staging copy of the training state, written to disk by
+// a background thread.
+typedef struct {
+  value_t *staging; // parameters, then extra state
+  len_t nparams;
+  len_t nextra;
+  uint64_t epoch;
+  uint64_t step;
+  const char *path;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool pending; // staging holds a snapshot not yet written
+  bool stop;
+  int status; // result of the last write
+} ckpt_t;
+#endif
+
+// Dense layer: row-major weight matrix and bias vector, their gradients, and
+// the activations of the last forward pass.
+typedef struct {
+  len_t nin;
+  len_t nout;
+  value_t *w;  // nout rows of nin weights
+  value_t *b;  // nout biases
+  value_t *dw; // gradients of w
+  value_t *db; // gradients of b
+  value_t *out;
+} dlayer_t;
+
+// Dense network: a feed-forward network of tanh layers that keeps its
+// parameters in contiguous matrices instead of on the tape.
+typedef struct {
+  Slice(dlayer_t) layers;
+  value_t *in;    // input of the last forward pass
+  value_t *delta; // backward scratch area, two rows of the widest layer
+  len_t width;
+} dense_t;
+
+// Ensemble layer. Every parameter is stored once per model, the models
+// innermost: weight k of output j of model m is at w[(j * (nin + 1) + k) *
+// nmodels + m], the bias being weight nin.
+typedef struct {
+  len_t nin;
+  len_t nout;
+  value_t *w;
+  value_t *out; // activations, nout rows of nmodels values
+} elayer_t;
+
+// Ensemble: models of identical shape evaluated together, one model per
+// vector lane.
+typedef struct {
+  Slice(elayer_t) layers;
+  len_t nmodels;
+  len_t *votes; // scratch area of REDUCE_VOTE
+} ensemble_t;
+
+// How ensemblefwd combines the outputs of the models.
+typedef enum {
+  REDUCE_MEAN, // mean of every output across models
+  REDUCE_VOTE, // fraction of models whose largest output is this one
+} reduce_t;
+
+// Gradient accumulator: one running gradient sum per network parameter.
+typedef Slice(value_t) acc_t;
+
+// Memory of a model, laid out in a single buffer by arenainit.
+typedef struct {
+  // Layers, as given to netinitconv. convs may be NULL.
+  len_t nlens;
+  len_t *llens;
+  const conv_t *convs;
+  len_t consts;  // records kept below the tape mark, besides the network's
+  len_t records; // records of one sample, besides the forward pass
+  len_t samples; // samples recorded above the mark at once, zero means one
+  bool acc;      // whether to carve a gradient accumulator
+  len_t fit;     // samples given to netfit, zero for no netfit buffer
+  len_t infer;   // rows of a netinfer batch, zero for no netinfer buffer
+
+  // Set by arenainit
+  net_t net;
+  acc_t accum;
+  char *fitbuf;
+  len_t nfitbuf;
+  char *inferbuf;
+  len_t ninferbuf;
+} arena_t;
+
+// Phases of the library measured by the performance counters.
+typedef enum {
+  PERF_FWD,      // netfwd and netfwdsparse
+  PERF_BACKPROP, // tapebackprop
+  PERF_ZEROGRAD, // tapezerograd
+  PERF_GDSTEP,   // netgdstep
+  PERF_NPHASES,
+} perfphase_t;
+
+// Hardware events counted in every phase.
+typedef enum {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_CACHEMISSES,
+  PERF_BRANCHMISSES,
+  PERF_NEVENTS,
+} perfevent_t;
+
+// Events counted in a phase, over all its calls.
+typedef struct {
+  uint64_t calls;
+  uint64_t counts[PERF_NEVENTS];
+} perfstats_t;
+
+// Read one sample into a row of inputs and a row of targets. Returning false
+// signals the end of the stream.
+typedef bool (*streamread_t)(value_t *input, value_t *target, void *ctx);
+
+// Online trainer: one gradient step per sample, each recorded from the same
+// tape mark, with the losses of the last samples kept in a ring.
+typedef struct {
+  idx_t mark;
+  double rate;
+  loss_t loss;
+  vec_t input;
+  vec_t result;
+  value_t *x; // raw inputs of the current sample
+  value_t *y; // raw targets of the current sample
+  value_t *losses;
+  len_t window;
+  uint64_t count; // samples trained so far
+  value_t sum;    // of the losses in the ring
+  value_t sumsq;  // of their squares
+} stream_t;
+
 ///
 /// TAPE
 /// ===
@@ -92,6 +480,9 @@ typedef struct {
 /// The tape is a global, append-only log of operations. Every math op (vadd,
 /// vmul, vtanh, ...) appends a record. This is the foundation for autodiff.
 ///
+/// When compiled with GRADINO_POSIX there is one tape per thread, and every
+/// thread must initialize its own.
+///
 /// The tape must be initialized before any other call. Either provide your own
 /// buffer or let the library allocate:
 ///
@@ -106,24 +497,96 @@ typedef struct {
 
 // Return the buffer size required for a tape with given capacity.
 size_t tapesize(len_t n);
-// Initialize global tape with given capacity using provided buffer.
+// Initialize global tape with given capacity using provided buffer. The
+// random number generator of the tape is seeded with the current time.
 void tapeinit(len_t n, len_t nbuf, char *buffer);
 // Allocate and initialize a tape with given capacity. Free with GRADINO_FREE.
 void *tapecreate(len_t n);
+// Seed the random number generator of the tape, which draws the initial
+// network parameters. The same seed yields the same parameters.
+void tapeseed(uint64_t seed);
 // Read a value from the tape.
-value_t tapeval(idx_t idx);
+GRADINO_HOT value_t tapeval(idx_t idx);
 // Read the gradient of a value from the tape.
 // It will be zero until a tapebackprop is called.
-value_t tapegrad(idx_t idx);
+GRADINO_HOT value_t tapegrad(idx_t idx);
 // Checkpoint current tape length. Use the mark in tapereset to
 // optimize tape usage.
-idx_t tapemark(void);
-// Reset tape length to a previous checkpoint.
+GRADINO_HOT idx_t tapemark(void);
+// Reset tape length to a previous checkpoint. Interned constants recorded
+// before the mark survive the reset.
 void tapereset(idx_t mark);
 // Calculate gradient components in the tape via backpropagation from start.
 void tapebackprop(idx_t start);
 // Zero the gradient component of all the values in the tape.
 void tapezerograd(void);
+// Remove the records in [from, tapemark()) that do not contribute to root,
+// and renumber the survivors in place preserving their order. Records below
+// from are always kept; pass a mark to preserve parameters and constants.
+// remap must hold tapemark() elements: on return, remap[i] is the new index
+// of value i, or IDX_NONE if it was removed. Returns the number of removed
+// records. Use vecremap to update indices held outside of the tape.
+len_t tapecompact(idx_t from, idx_t root, idx_t *remap);
+// Attach a read-only segment to the bottom of an empty tape. Indices below
+// seg->len read the segment, and the tape capacity is spent on the records
+// pushed after it. Segment values never receive gradients. See netfreeze.
+void tapeattach(const seg_t *seg);
+
+///
+/// SCHEDULE
+/// ===
+///
+/// A schedule is an alternative backward engine. Records are grouped by their
+/// distance from the root: all the records of a level depend only on records
+/// of earlier levels, so a level can be processed in parallel. Each record
+/// pulls the gradient from its users instead of having them push into it,
+/// hence threads never write the same gradient and results do not depend on
+/// the number of threads.
+///
+/// Computing a schedule costs about as much as a backward pass, but the same
+/// schedule can be reused as long as the graph is recorded again with the same
+/// structure, as is the case for forward passes of a network after tapereset.
+///
+///   idx_t loss = ...;
+///   sched_t sched;
+///   char *buf = malloc(schedsize(loss));
+///   schedinit(&sched, loss, schedsize(loss), buf);
+///   schedpool_t pool;
+///   schedstart(&pool, 4);
+///   for (...) {
+///     tapereset(mark);
+///     loss = ...; // same graph, same indices
+///     tapezerograd();
+///     schedbackprop(&sched, &pool);
+///   }
+///   schedstop(&pool);
+///
+/// The threads of a pool are spawned once and sleep between calls, so that a
+/// training loop does not pay for creating them at every step. A pool serves
+/// one calling thread at a time, on that thread's tape.
+///
+/// Multi-threading requires GRADINO_POSIX to be defined when compiling, and
+/// linking with pthreads. Otherwise, or without a pool, schedbackprop runs on
+/// the calling thread.
+
+// Return the buffer size required for a schedule rooted at root.
+size_t schedsize(idx_t root);
+// Compute the schedule of the records reachable from root, using provided
+// buffer.
+void schedinit(sched_t *s, idx_t root, len_t nbuf, char *buffer);
+// Allocate and compute a schedule. Free with GRADINO_FREE.
+sched_t *schedcreate(idx_t root);
+// Calculate gradient components in the tape via backpropagation from the
+// schedule root, spreading each level across the threads of pool, if any.
+void schedbackprop(const sched_t *s, schedpool_t *pool);
+#ifdef GRADINO_POSIX
+// Start a pool of nthreads threads, the caller of schedbackprop included.
+// Runs with fewer threads when the system refuses to create more. Returns 0
+// on success, -1 on failure.
+int schedstart(schedpool_t *p, len_t nthreads);
+// Stop the threads of a pool.
+void schedstop(schedpool_t *p);
+#endif
 
 ///
 /// VALUE
@@ -140,18 +603,45 @@ void tapezerograd(void);
 ///   tapegrad(b);              // dc/db = 2.0
 
 // Push a constant scalar onto the tape.
-idx_t vfrom(value_t a);
+GRADINO_HOT idx_t vfrom(value_t a);
+// Return an interned constant scalar, pushing it only the first time. Use it
+// for literals repeated in hot loops (zeros, targets, ...), and intern them
+// before tapemark so they persist across tapereset. Never pass the result to
+// code that mutates values, such as netgdstep.
+idx_t vconst(value_t a);
 // Add two recorded values.
-idx_t vadd(idx_t a, idx_t b);
+GRADINO_HOT idx_t vadd(idx_t a, idx_t b);
 // Multiply two recorded values.
-idx_t vmul(idx_t a, idx_t b);
+GRADINO_HOT idx_t vmul(idx_t a, idx_t b);
 // Subtract two recorded values.
-idx_t vsub(idx_t a, idx_t b);
+GRADINO_HOT idx_t vsub(idx_t a, idx_t b);
 // Apply tanh to a recorded value.
-idx_t vtanh(idx_t a);
+GRADINO_HOT idx_t vtanh(idx_t a);
 // Debug-print a single value.
 void vdbg(idx_t a, const char *label);
 
+///
+/// DUAL
+/// ===
+///
+/// Forward-mode autodiff on dual numbers. Operations propagate the tangent
+/// eagerly and nothing is recorded on the tape, so derivatives along one input
+/// direction (Jacobian-vector products) cost a single streaming pass.
+///
+///   dual_t x = dfrom(2.0, 1.0); // seed dx/dx = 1
+///   dual_t y = dmul(x, x);      // y.val = 4.0, y.tan = dy/dx = 4.0
+
+// Create a dual number from a value and its tangent.
+dual_t dfrom(value_t val, value_t tan);
+// Add two dual numbers.
+dual_t dadd(dual_t a, dual_t b);
+// Subtract two dual numbers.
+dual_t dsub(dual_t a, dual_t b);
+// Multiply two dual numbers.
+dual_t dmul(dual_t a, dual_t b);
+// Apply tanh to a dual number.
+dual_t dtanh(dual_t a);
+
 ///
 /// VECTOR
 /// ===
@@ -167,13 +657,16 @@ void vdbg(idx_t a, const char *label);
 void vecinit(vec_t *vec, len_t n, idx_t *data);
 // Debug-print a slice.
 void vecdbg(vec_t *vec, const char *label);
+// Rewrite the indices of a slice with a remap table from tapecompact.
+void vecremap(vec_t *vec, const idx_t *remap);
 
 ///
 /// NETWORK
 /// ===
 ///
-/// A feed-forward network of dense layers with tanh activation. Layer sizes
-/// are specified as an array: {input, hidden..., output}.
+/// A feed-forward network of dense or convolutional layers with tanh
+/// activation. Layer sizes are specified as an array: {input, hidden...,
+/// output}.
 ///
 ///   // Option 1: caller-managed buffer
 ///   len_t layers[] = {2, 4, 1};
@@ -208,11 +701,692 @@ void netinit(net_t *n, len_t nlens, len_t *llens, len_t nbuf, char *buffer);
 // Allocate and initialize a network with given layer sizes. Free with
 // GRADINO_FREE.
 net_t *netcreate(len_t nlens, len_t *llens);
+// Same as netsize, for a network with convolutional layers. convs[i] is the
+// geometry of the layer from llens[i] to llens[i + 1], or has zero filters
+// for a fully connected layer. Sizes must match the geometry: llens[i] is
+// height * width * channels, and llens[i + 1] the number of output positions
+// times filters.
+//
+//   // 3x3 board, 2x2 filters: 4 positions of 8 channels, then dense
+//   conv_t convs[] = {{3, 3, 1, 2, 8, 1}, {0}};
+//   len_t layers[] = {9, 32, 1};
+//   net_t *net = netcreateconv(3, layers, convs);
+//
+// Filters are shared by every position, hence their gradient accumulates the
+// contributions of all positions during backpropagation.
+size_t netsizeconv(len_t nlens, len_t *llens, const conv_t *convs);
+// Same as netinit, for a network with convolutional layers.
+void netinitconv(net_t *n, len_t nlens, len_t *llens, const conv_t *convs,
+                 len_t nbuf, char *buffer);
+// Same as netcreate, for a network with convolutional layers.
+net_t *netcreateconv(len_t nlens, len_t *llens, const conv_t *convs);
+// Draw new network parameters with the given scheme. netinit and netcreate
+// use INIT_UNIFORM; prefer INIT_XAVIER or INIT_HE for wide layers.
+void netrand(const net_t *n, init_t init);
 // Forward pass through the network.
 // Requires: input->len == llens[0], result->len == llens[nlens-1].
 void netfwd(net_t *n, const vec_t *input, vec_t *result);
+// Forward pass in forward mode, without recording on the tape. The tangents
+// of input are a direction in input space; the tangents of result are the
+// Jacobian-vector product of the network along that direction.
+// Requires: input->len == llens[0], result->len == llens[nlens-1].
+void netjvp(net_t *n, const dvec_t *input, dvec_t *result);
+// Freeze the bottom of the tape, up to the network parameters, into a segment
+// that the tapes of other threads can attach. The parameters must not change
+// while the segment is in use.
+//
+//   // Main thread, after training
+//   seg_t seg = netfreeze(net);
+//
+//   // Worker threads: own tape for the activations, own scratch areas
+//   tapeinit(1024, sizeof(tapebuf), tapebuf);
+//   tapeattach(&seg);
+//   net_t local;
+//   netview(&local, net, sizeof(viewbuf), viewbuf);
+//   netfwd(&local, &input, &result);
+seg_t netfreeze(const net_t *n);
+// Return the buffer size required for a view of the given network.
+size_t netviewsize(const net_t *n);
+// Initialize a view of a network: it shares the layers and parameters of src,
+// but has its own scratch areas so that several threads can run forward
+// passes at the same time.
+void netview(net_t *dst, const net_t *src, len_t nbuf, char *buffer);
+// Forward pass through the network with a sparse input. The first layer only
+// records the products of the nonzero entries, so both its forward and
+// backward costs scale with the number of nonzeros rather than the input
+// width. Positions must be less than llens[0], and the first layer must be
+// fully connected and not pruned.
+//
+//   sparse_t entries[2] = {{3, vfrom(1.0)}, {7, vfrom(0.5)}};
+//   svec_t input = {2, entries};
+//   netfwdsparse(net, &input, &result);
+void netfwdsparse(net_t *n, const svec_t *input, vec_t *result);
+// Return the buffer size required by netinfer for a batch of count rows.
+size_t infersize(const net_t *n, len_t count);
+// Forward pass over a batch of raw input rows, writing raw output rows. Nothing
+// is recorded on the tape, so it only fits inference; it reads the parameters
+// once per batch rather than once per row.
+//
+//   value_t inputs[8][2], outputs[8][1];
+//   char *buf = malloc(infersize(net, 8));
+//   netinfer(net, &inputs[0][0], 8, &outputs[0][0], infersize(net, 8), buf);
+void netinfer(const net_t *n, const value_t *inputs, len_t count,
+              value_t *outputs, len_t nbuf, char *buffer);
+// Save the layer sizes and parameters of a network to a file. Returns 0 on
+// success, -1 on failure.
+int netsave(const net_t *n, const char *path);
+// Load the parameters saved by netsave into a network of the same shape.
+// Returns 0 on success, -1 on failure, in which case the network is left
+// untouched.
+int netload(const net_t *n, const char *path);
 // Performs a gradient descend step. It can be used for both stochastic and
 // batch gradient descend.
 void netgdstep(const net_t *n, double rate);
+// Return the buffer size required by netfit for the given configuration.
+size_t fitsize(const net_t *n, const fit_t *f);
+// Return the learning rate netfit uses for an epoch, following the warmup
+// and the decay of the configuration.
+double fitrate(const fit_t *f, len_t epoch);
+// Train the network on a dataset of raw values, for the given number of
+// epochs, with minibatch gradient descend. Every sample is recorded above the
+// current tape mark, which is restored between samples, so the tape only
+// needs room for one sample. Returns the mean loss of the last epoch or, with
+// a validation split, the validation loss of the restored parameters.
+//
+//   fit_t fit = {0};
+//   fit.inputs = inputs;   // value_t[nsamples][llens[0]]
+//   fit.targets = targets; // value_t[nsamples][llens[nlens-1]]
+//   fit.nsamples = nsamples;
+//   fit.epochs = 100;
+//   fit.batch = 8;
+//   fit.rate = 0.01;
+//   fit.loss = LOSS_SQUARED;
+//   fit.shuffle = true;
+//   char *buf = malloc(fitsize(net, &fit));
+//   netfit(net, &fit, fitsize(net, &fit), buf);
+//
+// To stop once the model no longer improves, with a cosine schedule:
+//
+//   fit.decay = DECAY_COSINE;
+//   fit.warmup = 5;
+//   fit.vinputs = vinputs;   // value_t[nvalid][llens[0]]
+//   fit.vtargets = vtargets; // value_t[nvalid][llens[nlens-1]]
+//   fit.nvalid = nvalid;
+//   fit.patience = 20;
+value_t netfit(net_t *n, const fit_t *f, len_t nbuf, char *buffer);
 // Debug-print a network.
 void netdbg(const net_t *n, const char *label);
+
+///
+/// GRADIENT ACCUMULATOR
+/// ===
+///
+/// Collects the parameter gradients of a network across samples, so that the
+/// tape can be reset after every sample while still performing batch gradient
+/// descend. Tape memory stays constant regardless of the batch size.
+///
+///   acc_t acc;
+///   static char accbuf[1024];
+///   accinit(&acc, net, sizeof(accbuf), accbuf);
+///
+///   idx_t mark = tapemark();
+///   for (len_t i = 0; i < nsamples; i++) {
+///     tapereset(mark);
+///     // ... forward pass and loss ...
+///     tapezerograd();
+///     tapebackprop(loss);
+///     acccollect(&acc, net);
+///     if ((i + 1) % BATCH == 0)
+///       accstep(&acc, net, 0.01);
+///   }
+
+// Return the buffer size required for an accumulator of the given network.
+size_t accsize(const net_t *n);
+// Initialize an accumulator for the given network using provided buffer.
+void accinit(acc_t *a, const net_t *n, len_t nbuf, char *buffer);
+// Allocate and initialize an accumulator. Free with GRADINO_FREE.
+acc_t *acccreate(const net_t *n);
+// Add the current tape gradients of the network parameters to the accumulator.
+void acccollect(acc_t *a, const net_t *n);
+// Perform a gradient descend step with the accumulated gradients, then clear
+// the accumulator. The step uses the sum of the collected gradients, like
+// netgdstep would after backpropagating all the samples on the same tape.
+void accstep(acc_t *a, const net_t *n, double rate);
+
+///
+/// DENSE NETWORK
+/// ===
+///
+/// An alternative representation of a feed-forward network of tanh layers.
+/// Each layer owns a row-major weight matrix, a bias vector and matching
+/// gradients, so the math runs over contiguous memory with no indirection
+/// through the tape. Only the layer boundary touches the tape: densefwd reads
+/// the input values and records the outputs as constants, and densebwd reads
+/// the gradients of the outputs after tapebackprop.
+///
+///   len_t layers[] = {2, 64, 1};
+///   dense_t *dn = densecreate(3, layers);
+///
+///   densefwd(dn, &input, &result);
+///   idx_t loss = ...; // built from result on the tape
+///   tapezerograd();
+///   tapebackprop(loss);
+///   densezerograd(dn);
+///   densebwd(dn, &input, &result);
+///   densegdstep(dn, 0.01);
+///
+///   GRADINO_FREE(dn);
+
+// Return the buffer size required for a dense network with given layer sizes.
+// nlens is the number of elements in llens, llens[i] is the size of layer i.
+size_t densesize(len_t nlens, len_t *llens);
+// Initialize a dense network with given layer sizes using provided buffer.
+// Parameters are drawn as in netinit.
+void denseinit(dense_t *d, len_t nlens, len_t *llens, len_t nbuf,
+               char *buffer);
+// Allocate and initialize a dense network. Free with GRADINO_FREE.
+dense_t *densecreate(len_t nlens, len_t *llens);
+// Draw new parameters with the given scheme.
+void denserand(const dense_t *d, init_t init);
+// Forward pass. Reads the values of input from the tape and pushes the
+// outputs onto it as constants.
+// Requires: input->len == llens[0], result->len == llens[nlens-1].
+void densefwd(dense_t *d, const vec_t *input, vec_t *result);
+// Backward pass for the last densefwd. Reads the gradients of result from
+// the tape, accumulates the parameter gradients, and adds the gradients of
+// the inputs to the tape.
+void densebwd(dense_t *d, const vec_t *input, const vec_t *result);
+// Zero the parameter gradients.
+void densezerograd(const dense_t *d);
+// Performs a gradient descend step.
+void densegdstep(const dense_t *d, double rate);
+
+///
+/// DATASET
+/// ===
+///
+/// Datasets live on disk in a binary format: a 64 bytes header, followed by
+/// the input rows and the target rows, stored as contiguous value_t matrices.
+/// Opening a dataset maps the file in memory, hence rows are read with no
+/// parsing and no copies, and can be fed straight to netfit.
+///
+///   datawrite("digits.dat", inputs, targets, nrows, nin, nout);
+///
+///   data_t data;
+///   if (dataopen(&data, "digits.dat") != 0)
+///     return 1;
+///   fit.inputs = data.inputs;
+///   fit.targets = data.targets;
+///   fit.nsamples = data.nrows;
+///   ...
+///   dataclose(&data);
+///
+/// Datasets larger than memory can be streamed by blocks. Blocks are visited
+/// in a random order, rows within a block in file order, and the kernel is
+/// asked to read the next block ahead:
+///
+///   dataiter_t it;
+///   char *buf = malloc(dataitersize(&data, 4096));
+///   dataiterinit(&it, &data, 4096, true, dataitersize(&data, 4096), buf);
+///   idx_t first;
+///   len_t count;
+///   while (datanext(&it, &first, &count)) {
+///     // rows first..first+count
+///   }
+///
+/// Mapping files requires GRADINO_POSIX; datawrite is always available.
+
+// Write a dataset file. Returns 0 on success, -1 on failure.
+int datawrite(const char *path, const value_t *inputs, const value_t *targets,
+              len_t nrows, len_t nin, len_t nout);
+#ifdef GRADINO_POSIX
+// Map a dataset file in memory. Returns 0 on success, -1 on failure (the file
+// cannot be read, is not a dataset, its header does not match its size, or it
+// was written with another value_t).
+int dataopen(data_t *d, const char *path);
+// Unmap a dataset.
+void dataclose(data_t *d);
+// Return the buffer size required for an iterator by blocks of block rows.
+size_t dataitersize(const data_t *d, len_t block);
+// Initialize an iterator by blocks of block rows using provided buffer.
+void dataiterinit(dataiter_t *it, const data_t *d, len_t block, bool shuffle,
+                  len_t nbuf, char *buffer);
+// Advance to the next block, setting its first row and number of rows.
+// Returns false at the end of an epoch, after which the iterator restarts
+// with a new order.
+bool datanext(dataiter_t *it, idx_t *first, len_t *count);
+#endif
+
+#ifdef GRADINO_POSIX
+///
+/// FEED
+/// ===
+///
+/// Prepares minibatches on a background thread while the caller trains on
+/// the current one. A user callback decodes, normalizes or shuffles rows into
+/// a ring of slots (two slots double-buffer). A side with nothing to do sleeps
+/// on a condition variable; the lock is only held to move the ends of the
+/// ring, while rows are written and read outside of it.
+///
+///   len_t fill(value_t *inputs, value_t *targets, len_t count, void *ctx) {
+///     // write up to count rows, return how many were written
+///   }
+///
+///   feed_t feed;
+///   size_t nbuf = feedsize(2, 32, nin, nout);
+///   feedinit(&feed, 2, 32, nin, nout, fill, ctx, nbuf, malloc(nbuf));
+///   feedstart(&feed);
+///   const value_t *x, *y;
+///   len_t count;
+///   while (feednext(&feed, &x, &y, &count)) {
+///     // train on count rows of x and y
+///   }
+///   feedstop(&feed);
+///
+/// The callback runs on its own thread. The tape of that thread holds no
+/// records: only its random number generator is set, seeded from the caller's
+/// one at feedstart, so the callback can draw orders with datanext but not
+/// record values.
+
+// Return the buffer size required by a feed of nslots slots of batch rows.
+size_t feedsize(len_t nslots, len_t batch, len_t nin, len_t nout);
+// Initialize a feed using provided buffer.
+void feedinit(feed_t *f, len_t nslots, len_t batch, len_t nin, len_t nout,
+              feedfill_t fill, void *ctx, len_t nbuf, char *buffer);
+// Start the producer thread. Returns 0 on success, -1 on failure.
+int feedstart(feed_t *f);
+// Wait for the next minibatch, releasing the previous one to the producer.
+// Returns false once the callback has run out of data.
+bool feednext(feed_t *f, const value_t **inputs, const value_t **targets,
+              len_t *count);
+// Stop the producer thread and wait for it to exit.
+void feedstop(feed_t *f);
+#endif
+
+///
+/// CHECKPOINT
+/// ===
+///
+/// Saves the training state periodically so that long runs can resume after
+/// a crash. A checkpoint holds the network parameters, optional extra state
+/// (an optimizer's, such as a gradient accumulator) and the epoch and step
+/// the run had reached. Snapshots are copied into a staging buffer at a step
+/// boundary, and a background thread writes them, so the training loop only
+/// pays for the copy. Files are replaced atomically: a crash during a write
+/// leaves the previous checkpoint intact, and a write that completed, its
+/// directory entry included, is on the device.
+///
+///   uint64_t epoch = 0, step = 0;
+///   ckptload("run.ckpt", net, acc.at, acc.len, &epoch, &step); // if any
+///
+///   ckpt_t ckpt;
+///   char *buf = malloc(ckptsize(net, acc.len));
+///   ckptinit(&ckpt, net, acc.len, "run.ckpt", ckptsize(net, acc.len), buf);
+///   for (; epoch < EPOCHS; epoch++) {
+///     ...
+///     ckptsave(&ckpt, net, acc.at, epoch + 1, 0);
+///   }
+///   ckptstop(&ckpt);
+///
+/// Loading is always available; writing requires GRADINO_POSIX.
+
+// Load a checkpoint into a network of the same shape, with nextra values of
+// extra state, and set the epoch and step it was taken at. Returns 0 on
+// success, -1 on failure, in which case nothing is modified.
+int ckptload(const char *path, const net_t *n, value_t *extra, len_t nextra,
+             uint64_t *epoch, uint64_t *step);
+#ifdef GRADINO_POSIX
+// Return the buffer size required by a checkpoint writer.
+size_t ckptsize(const net_t *n, len_t nextra);
+// Initialize a checkpoint writer for path, using provided buffer, and start
+// its thread. Returns 0 on success, -1 on failure.
+int ckptinit(ckpt_t *c, const net_t *n, len_t nextra, const char *path,
+             len_t nbuf, char *buffer);
+// Snapshot the network parameters, nextra values of extra state and the
+// cursor of the run, and queue them for writing. Returns false, without
+// copying, if the previous snapshot is still being written.
+bool ckptsave(ckpt_t *c, const net_t *n, const value_t *extra, uint64_t epoch,
+              uint64_t step);
+// Wait for the queued snapshot to be on disk. Returns 0 if the last write
+// succeeded, -1 otherwise.
+int ckptwait(ckpt_t *c);
+// Write the queued snapshot, if any, and stop the writer thread. Returns the
+// same as ckptwait.
+int ckptstop(ckpt_t *c);
+#endif
+
+///
+/// PRUNING
+/// ===
+///
+/// Removes the weights of small magnitude from a trained network. Pruned
+/// layers keep their weights in compressed sparse rows, so that forward and
+/// backward passes only record the remaining connections, and netgdstep only
+/// updates the remaining parameters. The sparsity mask is fixed: training a
+/// pruned network fine-tunes the weights that are left.
+///
+///   char *buf = malloc(prunesize(net));
+///   pruneinit(net, prunesize(net), buf);
+///   netprunetopk(net, 16);      // keep 16 weights per perceptron
+///   netfit(net, &fit, ...);     // fine-tune
+///   netprune(net, 0.01);        // then drop what has become small
+///
+/// Convolutional layers are left dense. netrand redraws only the remaining
+/// weights, and since pruning repacks the parameters, a model saved by netsave
+/// only loads back into a network pruned the same way.
+
+// Return the buffer size required to prune a network.
+size_t prunesize(const net_t *n);
+// Convert the fully connected layers of a network to sparse rows, keeping
+// every weight, using provided buffer.
+void pruneinit(net_t *n, len_t nbuf, char *buffer);
+// Remove the weights whose magnitude is below threshold. Returns the number of
+// weights removed.
+len_t netprune(net_t *n, value_t threshold);
+// Keep the k weights of largest magnitude in every perceptron. Returns the
+// number of weights removed.
+len_t netprunetopk(net_t *n, len_t k);
+
+///
+/// ARENA
+/// ===
+///
+/// Sizes and lays out everything a model needs in one buffer: the tape, the
+/// network, and optionally an accumulator and the netfit and netinfer
+/// buffers. The tape is sized for the parameters plus the largest graph of a
+/// step, so there are no sizes to guess. Every region starts on its own cache
+/// line, hence regions written by different threads never share one.
+///
+///   arena_t arena = {0};
+///   arena.nlens = 3;
+///   arena.llens = (len_t[]){9, 27, 9};
+///   arena.records = 9 + 4 * 9; // inputs and loss
+///   arena.samples = 1;
+///   arena.infer = 64;
+///   char *buf = malloc(arenasize(&arena));
+///   arenainit(&arena, arenasize(&arena), buf);
+///   netfwd(&arena.net, &input, &result);
+///
+/// The arena initializes the tape of the calling thread, which must not have
+/// recorded anything yet.
+
+// Return the tape capacity an arena needs.
+len_t arenarecords(const arena_t *a);
+// Return the buffer size required for an arena.
+size_t arenasize(const arena_t *a);
+// Initialize the tape and the network of an arena, and carve out the other
+// regions, using provided buffer.
+void arenainit(arena_t *a, len_t nbuf, char *buffer);
+// Allocate and initialize an arena. Free with GRADINO_FREE.
+void *arenacreate(arena_t *a);
+
+///
+/// SECOND ORDER
+/// ===
+///
+/// Curvature-aware training for small, full-batch problems. The objective is
+/// the mean netfit loss over every sample of a fit_t. Samples are recorded one
+/// at a time above the tape mark as in netfit, so the tape only needs room for
+/// one sample.
+///
+/// nethvp multiplies the Hessian of the objective by a vector, with a central
+/// difference of two backpropagated gradients. netlbfgs minimizes the
+/// objective with limited-memory BFGS and a backtracking line search, keeping
+/// the last steps in the provided buffer. It usually converges in tens of
+/// iterations where netfit needs thousands of epochs.
+///
+///   fit_t fit = {0};
+///   fit.inputs = inputs;
+///   fit.targets = targets;
+///   fit.nsamples = nsamples;
+///   fit.epochs = 100; // iterations
+///   fit.loss = LOSS_MEAN;
+///   char *buf = malloc(lbfgssize(net, 8));
+///   netlbfgs(net, &fit, 8, lbfgssize(net, 8), buf);
+
+// Return the buffer size required by nethvp.
+size_t hvpsize(const net_t *n);
+// Multiply the Hessian of the full-batch loss at the current parameters by v,
+// into hv. Both have one value per network parameter, in n->params order.
+// Parameters are left unchanged.
+void nethvp(net_t *n, const fit_t *f, const value_t *v, value_t *hv,
+            len_t nbuf, char *buffer);
+// Return the buffer size required by netlbfgs for a history of given length.
+size_t lbfgssize(const net_t *n, len_t history);
+// Train the network on the full batch of f with L-BFGS, keeping the last
+// history steps. f->epochs bounds the iterations and f->onepoch is called
+// after each one, while batch, rate and shuffle are ignored. Stops early when
+// the line search cannot decrease the loss anymore. Returns the final mean
+// loss per sample.
+value_t netlbfgs(net_t *n, const fit_t *f, len_t history, len_t nbuf,
+                 char *buffer);
+
+///
+/// STREAM
+/// ===
+///
+/// Trains a network online from a stream of samples, for processes that run
+/// for days. Every sample is recorded from the mark taken by streaminit, so
+/// the graph space above the parameters is recycled automatically and the
+/// tape footprint, like the latency of an update, stays constant. The loss
+/// of the last window samples is tracked as a rolling mean and deviation.
+///
+///   stream_t s;
+///   char *buf = malloc(streamsize(net, 1000));
+///   streaminit(&s, net, 0.01, LOSS_SQUARED, 1000, streamsize(net, 1000), buf);
+///   netstream(&s, net, read, ctx); // or streamstep for every event
+///   value_t mean, dev;
+///   streamstats(&s, &mean, &dev);
+///
+/// Rows can also come from a file descriptor, such as a pipe or a socket,
+/// with netstreamfd.
+
+// Return the buffer size required by a stream whose rolling statistics cover
+// window samples.
+size_t streamsize(const net_t *n, len_t window);
+// Initialize a stream using provided buffer. The current tape mark becomes the
+// start of every sample's graph: intern the constants used by every sample
+// first. A zero window disables the rolling statistics.
+void streaminit(stream_t *s, const net_t *n, double rate, loss_t loss,
+                len_t window, len_t nbuf, char *buffer);
+// Train on one sample, and return its loss.
+value_t streamstep(stream_t *s, net_t *n, const value_t *input,
+                   const value_t *target);
+// Train on every sample read, until the end of the stream. Returns the number
+// of samples trained.
+uint64_t netstream(stream_t *s, net_t *n, streamread_t read, void *ctx);
+// Return the mean and the standard deviation of the losses of the last
+// window samples, or of every sample while fewer were trained.
+void streamstats(const stream_t *s, value_t *mean, value_t *dev);
+#ifdef GRADINO_POSIX
+// Same as netstream, reading rows of llens[0] inputs followed by
+// llens[nlens-1] targets, as raw value_t, from a file descriptor. Returns the
+// number of samples trained, and stops at the end of the file or on error.
+uint64_t netstreamfd(stream_t *s, net_t *n, int fd);
+#endif
+
+///
+/// ENSEMBLE
+/// ===
+///
+/// Evaluates many small networks of the same shape at once. Networks like
+/// 9-27-9 are too narrow for vectorizing a single forward pass, but the same
+/// weight of every model sits in adjacent memory here, so the inner loops run
+/// across models and vectorize instead. Train the models as networks, then
+/// copy them in:
+///
+///   len_t layers[] = {9, 27, 9};
+///   ensemble_t *e = ensemblecreate(32, 3, layers);
+///   for (len_t m = 0; m < 32; m++)
+///     ensembleset(e, m, nets[m]);
+///   value_t result[9];
+///   ensemblefwd(e, board, REDUCE_MEAN, result);
+///
+///   GRADINO_FREE(e);
+
+// Return the buffer size required for an ensemble of nmodels models with
+// given layer sizes.
+size_t ensemblesize(len_t nmodels, len_t nlens, len_t *llens);
+// Initialize an ensemble using provided buffer. Parameters are zero.
+void ensembleinit(ensemble_t *e, len_t nmodels, len_t nlens, len_t *llens,
+                  len_t nbuf, char *buffer);
+// Allocate and initialize an ensemble. Free with GRADINO_FREE.
+ensemble_t *ensemblecreate(len_t nmodels, len_t nlens, len_t *llens);
+// Copy the parameters of a fully connected, unpruned network of the same
+// shape into a model of the ensemble.
+void ensembleset(ensemble_t *e, len_t model, const net_t *n);
+// Evaluate every model on a row of raw inputs, without recording, and combine
+// their outputs into result. The outputs of each model remain in the out rows
+// of the last layer.
+void ensemblefwd(ensemble_t *e, const value_t *input, reduce_t reduce,
+                 value_t *result);
+
+///
+/// PERF
+/// ===
+///
+/// Counts cycles, instructions, cache misses and branch misses in the forward
+/// passes (netfwd and netfwdsparse), tapebackprop, tapezerograd and netgdstep,
+/// to tell whether a phase is bound by memory or by branches. Counting needs a
+/// library compiled with GRADINO_PERF on Linux (make PERF=1); otherwise the
+/// phases carry no instrumentation at all and perfopen fails.
+///
+///   if (perfopen() != 0)
+///     fputs("no performance counters, timings only\n", stderr);
+///   for (...) {
+///     // train
+///   }
+///   perfreport(stdout, nsamples);
+///   perfclose();
+///
+/// Counters are per thread and only count user space. The kernel may refuse
+/// some events (in virtual machines, or with a restrictive
+/// perf_event_paranoid): those are reported as unavailable, and the others
+/// are still counted.
+
+// Open the counters of the calling thread and start collecting. Returns 0
+// when at least one event can be counted, -1 otherwise.
+int perfopen(void);
+// Pause or resume collecting, without closing the counters.
+void perfenable(bool on);
+// Zero the counts of every phase.
+void perfreset(void);
+// Return whether an event is counted.
+bool perfhas(perfevent_t event);
+// Return the counts of a phase.
+perfstats_t perfstats(perfphase_t phase);
+// Print the counts of every phase, in total and per sample.
+void perfreport(FILE *out, uint64_t samples);
+// Close the counters of the calling thread.
+void perfclose(void);
+
+///
+/// HOT PATH
+/// ===
+///
+/// Definitions of the GRADINO_HOT functions, and of the primitives they record
+/// with. They are compiled in gradino.c, or inlined in every file when
+/// GRADINO_INLINE is defined. Nothing here is part of the API.
+
+#if defined(GRADINO_INLINE) || defined(GRADINO_SOURCE)
+#include <math.h>
+
+#ifdef GRADINO_POSIX
+#define GRADINO_TLS __thread
+#else
+#define GRADINO_TLS
+#endif
+
+// Print a formatted message and a stack trace, then exit. It backs the checks
+// of gradino.c, and of the functions below wherever they are compiled.
+#ifndef NDEBUG
+void gradino_panic(const char *file, int line, const char *fmt, ...);
+#define gradino_checkf(Assertion, Fmt, ...)                                    \
+  if (Assertion) {                                                             \
+    gradino_panic(__FILE__, __LINE__, Fmt, __VA_ARGS__);                       \
+  }
+#else
+#define gradino_checkf(Assertion, Fmt, ...) ((void)0)
+#endif
+
+// One tape per thread when threads are available. It is only visible outside
+// of gradino.c when the hot path is inlined.
+#ifdef GRADINO_INLINE
+extern GRADINO_TLS tape_t gradino_tape;
+#else
+static GRADINO_TLS tape_t gradino_tape;
+#endif
+
+// Records are stored from the base of the tape, which is zero unless the tape
+// is attached to a segment. Values below the base live in the segment.
+static inline value_t gradino_tval(idx_t idx) {
+  return idx < gradino_tape.base ? gradino_tape.shared[idx]
+                                 : gradino_tape.values[idx - gradino_tape.base];
+}
+
+// Push a record without checking the capacity.
+static inline idx_t gradino_tput(value_t val, optype_t type, idx_t in0,
+                                 idx_t in1) {
+  tape_t *t = &gradino_tape;
+  idx_t idx = t->len;
+  idx_t slot = idx - t->base;
+  t->values[slot] = val;
+  t->grads[slot] = 0;
+  t->ops[slot].type = type;
+  t->ops[slot].input[0] = in0;
+  t->ops[slot].input[1] = in1;
+  t->ops[slot].output = idx;
+  t->len++;
+  return idx;
+}
+
+static inline idx_t gradino_tpush(value_t val, optype_t type, idx_t in0,
+                                  idx_t in1) {
+  gradino_checkf(gradino_tape.len - gradino_tape.base >= gradino_tape.cap,
+                 "buffer full (cap=%lu, len=%lu, reserving %lu)",
+                 gradino_tape.cap, gradino_tape.len - gradino_tape.base, 1UL);
+  return gradino_tput(val, type, in0, in1);
+}
+
+GRADINO_HOT value_t tapeval(idx_t idx) {
+  gradino_checkf(idx >= gradino_tape.len,
+                 "index %lu out of bounds (len=%lu, cap=%lu)", idx,
+                 gradino_tape.len, gradino_tape.cap);
+  return gradino_tval(idx);
+}
+
+GRADINO_HOT value_t tapegrad(idx_t idx) {
+  gradino_checkf(idx >= gradino_tape.len,
+                 "index %lu out of bounds (len=%lu, cap=%lu)", idx,
+                 gradino_tape.len, gradino_tape.cap);
+  // Shared values are read-only, hence never accumulate a gradient
+  return idx < gradino_tape.base ? 0
+                                 : gradino_tape.grads[idx - gradino_tape.base];
+}
+
+GRADINO_HOT idx_t tapemark(void) { return gradino_tape.len; }
+
+GRADINO_HOT idx_t vfrom(value_t value) {
+  return gradino_tpush(value, OP_CONST, gradino_tape.len, gradino_tape.len);
+}
+
+GRADINO_HOT idx_t vadd(idx_t a, idx_t b) {
+  return gradino_tpush(tapeval(a) + tapeval(b), OP_ADD, a, b);
+}
+
+GRADINO_HOT idx_t vsub(idx_t a, idx_t b) {
+  return gradino_tpush(tapeval(a) - tapeval(b), OP_SUB, a, b);
+}
+
+GRADINO_HOT idx_t vmul(idx_t a, idx_t b) {
+  return gradino_tpush(tapeval(a) * tapeval(b), OP_MUL, a, b);
+}
+
+GRADINO_HOT idx_t vtanh(idx_t a) {
+  return gradino_tpush(tanh(tapeval(a)), OP_TANH, a, a);
+}
+#endif
+
+#ifdef GRADINO_IMPLEMENTATION
+#include "gradino.c"
+#endif
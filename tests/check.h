@@ -0,0 +1,81 @@
+// Checks shared by the tests. A test exits with status 1 at the first failed
+// check, like examples/00_backprop.
+#include "../gradino.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define assertnearf(actual, expected, tolerance)                               \
+  if (fabs((actual) - (expected)) > (tolerance)) {                             \
+    fprintf(stderr, "%s:%d Assertion error: expected %f; got %f\n", __FILE__,  \
+            __LINE__, (double)(expected), (double)(actual));                   \
+    exit(1);                                                                   \
+  }
+
+#define asserteqf(actual, expected) assertnearf(actual, expected, 1e-6)
+
+#define asserttrue(cond)                                                       \
+  if (!(cond)) {                                                               \
+    fprintf(stderr, "%s:%d Assertion error: %s\n", __FILE__, __LINE__, #cond); \
+    exit(1);                                                                   \
+  }
+
+enum { MAX_WIDTH = 64 };
+
+// Record the squared error of a network on one sample, and return it
+static inline idx_t sqloss(net_t *n, const value_t *x, const value_t *y) {
+  idx_t in[MAX_WIDTH], out[MAX_WIDTH];
+  vec_t input, result;
+  vecinit(&input, n->layers.at[0].nin, in);
+  vecinit(&result, n->layers.at[n->layers.len - 1].len, out);
+  for (idx_t i = 0; i < input.len; i++) {
+    in[i] = vfrom(x[i]);
+  }
+  netfwd(n, &input, &result);
+  idx_t loss = vfrom(0);
+  for (idx_t i = 0; i < result.len; i++) {
+    idx_t diff = vsub(out[i], vfrom(y[i]));
+    loss = vadd(loss, vmul(diff, diff));
+  }
+  return loss;
+}
+
+// Set the parameter of a network at index idx, through the public API: with
+// the gradient of that parameter alone set to one, a descend step moves only
+// that parameter
+static inline void paramset(const net_t *n, idx_t idx, value_t value) {
+  tapezerograd();
+  tapebackprop(idx);
+  netgdstep(n, tapeval(idx) - value);
+}
+
+// Compare the backpropagated gradient of every parameter of a network with a
+// central difference of the loss
+static inline void gradcheck(net_t *n, const value_t *x, const value_t *y) {
+  const value_t eps = 1e-5;
+  static value_t grads[1 << 12];
+  asserttrue(n->params.len <= sizeof(grads) / sizeof(grads[0]));
+  idx_t mark = tapemark();
+  idx_t loss = sqloss(n, x, y);
+  tapezerograd();
+  tapebackprop(loss);
+  for (idx_t j = 0; j < n->params.len; j++) {
+    grads[j] = tapegrad(n->params.at[j]);
+  }
+
+  for (idx_t j = 0; j < n->params.len; j++) {
+    value_t value = tapeval(n->params.at[j]);
+
+    tapereset(mark);
+    paramset(n, n->params.at[j], value + eps);
+    value_t above = tapeval(sqloss(n, x, y));
+    tapereset(mark);
+    paramset(n, n->params.at[j], value - eps);
+    value_t below = tapeval(sqloss(n, x, y));
+    tapereset(mark);
+    paramset(n, n->params.at[j], value);
+
+    assertnearf(grads[j], (above - below) / (2 * eps), 1e-6);
+  }
+  tapereset(mark);
+}
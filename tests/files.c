@@ -0,0 +1,133 @@
+// Files: dataset round trips and validation, checkpoints.
+#include "check.h"
+#include <string.h>
+#include <unistd.h>
+
+#define len(Arr) sizeof(Arr) / sizeof(Arr[0])
+
+static const char *PATH = "tests/files.tmp";
+
+// Overwrite a 64-bit field of a file
+static void patch(long offset, uint64_t value) {
+  FILE *f = fopen(PATH, "r+b");
+  asserttrue(f);
+  asserttrue(fseek(f, offset, SEEK_SET) == 0);
+  asserttrue(fwrite(&value, sizeof(value), 1, f) == 1);
+  asserttrue(fclose(f) == 0);
+}
+
+static void testdata(void) {
+  enum { NROWS = 3, NIN = 2, NOUT = 1 };
+  const value_t inputs[NROWS][NIN] = {{1, 2}, {3, 4}, {5, 6}};
+  const value_t targets[NROWS][NOUT] = {{-1}, {-2}, {-3}};
+  // Offsets of the header fields
+  enum { NROWS_AT = 16, NIN_AT = 24, NOUT_AT = 32 };
+
+  asserttrue(datawrite(PATH, &inputs[0][0], &targets[0][0], NROWS, NIN,
+                       NOUT) == 0);
+  data_t d = {0};
+  asserttrue(dataopen(&d, PATH) == 0);
+  asserttrue(d.nrows == NROWS && d.nin == NIN && d.nout == NOUT);
+  for (idx_t r = 0; r < NROWS; r++) {
+    for (idx_t i = 0; i < NIN; i++) {
+      asserteqf(d.inputs[r * NIN + i], inputs[r][i]);
+    }
+    asserteqf(d.targets[r], targets[r][0]);
+  }
+  dataclose(&d);
+
+  // Headers that do not describe the file are rejected
+  asserttrue(dataopen(&d, "tests/missing.tmp") == -1);
+
+  patch(NROWS_AT, ((uint64_t)1 << 62) + 1);
+  asserttrue(dataopen(&d, PATH) == -1);
+  patch(NROWS_AT, NROWS + 1);
+  asserttrue(dataopen(&d, PATH) == -1);
+  patch(NROWS_AT, NROWS);
+  asserttrue(dataopen(&d, PATH) == 0);
+  dataclose(&d);
+
+  // Same number of values per row, but no inputs
+  patch(NIN_AT, 0);
+  patch(NOUT_AT, NIN + NOUT);
+  asserttrue(dataopen(&d, PATH) == -1);
+  patch(NIN_AT, NIN + NOUT);
+  patch(NOUT_AT, 0);
+  asserttrue(dataopen(&d, PATH) == -1);
+  patch(NIN_AT, (uint64_t)-1);
+  patch(NOUT_AT, NIN + NOUT + 1);
+  asserttrue(dataopen(&d, PATH) == -1);
+
+  patch(0, 0);
+  asserttrue(dataopen(&d, PATH) == -1);
+
+  // One row of one input and one target, claiming 2^62 + 1 rows: the size
+  // computed from the header wraps around to the size of the file
+  asserttrue(datawrite(PATH, &inputs[0][0], &targets[0][0], 1, 1, 1) == 0);
+  patch(NROWS_AT, ((uint64_t)1 << 62) + 1);
+  asserttrue(dataopen(&d, PATH) == -1);
+
+  asserttrue(datawrite(PATH, &inputs[0][0], &targets[0][0], NROWS, NIN,
+                       NOUT) == 0);
+  asserttrue(truncate(PATH, 64 + sizeof(value_t) * 8) == 0);
+  asserttrue(dataopen(&d, PATH) == -1);
+  unlink(PATH);
+}
+
+static void testckpt(void) {
+  len_t llens[] = {3, 4, 2};
+  tapeseed(5);
+  net_t *saved = netcreate(len(llens), llens);
+  tapeseed(6);
+  net_t *loaded = netcreate(len(llens), llens);
+  char *buf = malloc(ckptsize(saved, 3));
+  asserttrue(saved && loaded && buf);
+
+  value_t extra[3] = {1, 2, 3};
+  ckpt_t c;
+  asserttrue(ckptinit(&c, saved, 3, PATH, (len_t)ckptsize(saved, 3), buf) ==
+             0);
+  asserttrue(ckptsave(&c, saved, extra, 5, 7));
+  asserttrue(ckptstop(&c) == 0);
+
+  // A mismatching shape leaves the network as it was
+  value_t before = tapeval(loaded->params.at[0]);
+  value_t back[3] = {0};
+  uint64_t epoch = 0, step = 0;
+  asserttrue(ckptload(PATH, loaded, back, 2, &epoch, &step) == -1);
+  asserteqf(tapeval(loaded->params.at[0]), before);
+  asserttrue(epoch == 0 && step == 0);
+
+  asserttrue(ckptload(PATH, loaded, back, 3, &epoch, &step) == 0);
+  asserttrue(epoch == 5 && step == 7);
+  for (idx_t i = 0; i < 3; i++) {
+    asserteqf(back[i], extra[i]);
+  }
+  for (idx_t j = 0; j < saved->params.len; j++) {
+    asserteqf(tapeval(loaded->params.at[j]), tapeval(saved->params.at[j]));
+  }
+
+  // So does a truncated file
+  tapeseed(7);
+  netrand(loaded, INIT_UNIFORM);
+  before = tapeval(loaded->params.at[0]);
+  asserttrue(truncate(PATH, 64) == 0);
+  asserttrue(ckptload(PATH, loaded, back, 3, &epoch, &step) == -1);
+  asserteqf(tapeval(loaded->params.at[0]), before);
+
+  unlink(PATH);
+  free(buf);
+  GRADINO_FREE(loaded);
+  GRADINO_FREE(saved);
+}
+
+int main(void) {
+  void *tapebuf = tapecreate(1 << 12);
+  asserttrue(tapebuf);
+
+  testdata();
+  testckpt();
+
+  GRADINO_FREE(tapebuf);
+  return 0;
+}
@@ -0,0 +1,405 @@
+// Layers: sparse inputs, dense networks, convolutions, pruning, second order
+// methods and ensembles.
+#include "check.h"
+
+#define len(Arr) sizeof(Arr) / sizeof(Arr[0])
+
+static const value_t X[3][9] = {
+    {1, -1, 0, 0, 1, -1, 0, 0, 1},
+    {0.5, 0.2, -0.4, 0.9, -0.1, 0.3, -0.8, 0.6, 0.0},
+    {-1, 0, 1, -1, 0, 1, -1, 0, 1},
+};
+static const value_t Y[3][3] = {{1, -1, 0}, {0.2, 0.4, -0.6}, {-1, 0.5, 0.5}};
+
+static char inferbuf[1 << 14];
+
+// A sparse input computes the outputs and gradients of the dense input with
+// the same nonzero entries
+static void testsparse(void) {
+  len_t llens[] = {9, 6, 3};
+  net_t *n = netcreate(len(llens), llens);
+  asserttrue(n);
+  static value_t grads[256];
+  asserttrue(n->params.len <= len(grads));
+
+  idx_t mark = tapemark();
+  for (idx_t s = 0; s < len(X); s++) {
+    idx_t in[9], out[3];
+    vec_t input, result;
+    vecinit(&input, 9, in);
+    vecinit(&result, 3, out);
+    for (idx_t i = 0; i < 9; i++) {
+      in[i] = vfrom(X[s][i]);
+    }
+    netfwd(n, &input, &result);
+    idx_t loss = vfrom(0);
+    for (idx_t o = 0; o < 3; o++) {
+      idx_t diff = vsub(out[o], vfrom(Y[s][o]));
+      loss = vadd(loss, vmul(diff, diff));
+    }
+    tapezerograd();
+    tapebackprop(loss);
+    value_t dense[3], dgrads[9];
+    for (idx_t o = 0; o < 3; o++) {
+      dense[o] = tapeval(out[o]);
+    }
+    for (idx_t i = 0; i < 9; i++) {
+      dgrads[i] = tapegrad(in[i]);
+    }
+    for (idx_t j = 0; j < n->params.len; j++) {
+      grads[j] = tapegrad(n->params.at[j]);
+    }
+    tapereset(mark);
+
+    sparse_t entries[9];
+    svec_t sinput = {0, entries};
+    for (idx_t i = 0; i < 9; i++) {
+      if (fabs(X[s][i]) > 0)
+        entries[sinput.len++] = (sparse_t){i, vfrom(X[s][i])};
+    }
+    netfwdsparse(n, &sinput, &result);
+    loss = vfrom(0);
+    for (idx_t o = 0; o < 3; o++) {
+      idx_t diff = vsub(out[o], vfrom(Y[s][o]));
+      loss = vadd(loss, vmul(diff, diff));
+    }
+    tapezerograd();
+    tapebackprop(loss);
+    for (idx_t o = 0; o < 3; o++) {
+      asserteqf(tapeval(out[o]), dense[o]);
+    }
+    for (idx_t k = 0; k < sinput.len; k++) {
+      asserteqf(tapegrad(entries[k].val), dgrads[entries[k].pos]);
+    }
+    for (idx_t j = 0; j < n->params.len; j++) {
+      asserteqf(tapegrad(n->params.at[j]), grads[j]);
+    }
+    tapereset(mark);
+  }
+  GRADINO_FREE(n);
+}
+
+// Record the squared error of a dense network on one sample, and return it
+static idx_t denseloss(dense_t *d, vec_t *input, vec_t *result,
+                       const value_t *y) {
+  densefwd(d, input, result);
+  idx_t loss = vfrom(0);
+  for (idx_t o = 0; o < 3; o++) {
+    idx_t diff = vsub(result->at[o], vfrom(y[o]));
+    loss = vadd(loss, vmul(diff, diff));
+  }
+  return loss;
+}
+
+// The gradients of densebwd, for the parameters and the inputs, match central
+// differences of the loss
+static void testdense(void) {
+  const value_t eps = 1e-5;
+  len_t llens[] = {9, 6, 5, 3};
+  dense_t *d = densecreate(len(llens), llens);
+  asserttrue(d);
+
+  idx_t mark = tapemark();
+  for (idx_t s = 0; s < len(X); s++) {
+    idx_t in[9], out[3];
+    vec_t input, result;
+    vecinit(&input, 9, in);
+    vecinit(&result, 3, out);
+    for (idx_t i = 0; i < 9; i++) {
+      in[i] = vfrom(X[s][i]);
+    }
+    idx_t loss = denseloss(d, &input, &result, Y[s]);
+    tapezerograd();
+    tapebackprop(loss);
+    densezerograd(d);
+    densebwd(d, &input, &result);
+
+    for (idx_t l = 0; l < d->layers.len; l++) {
+      const dlayer_t *layer = &d->layers.at[l];
+      for (idx_t j = 0; j < layer->nout * (layer->nin + 1); j++) {
+        bool bias = j >= layer->nout * layer->nin;
+        value_t *param = bias ? &layer->b[j - layer->nout * layer->nin]
+                              : &layer->w[j];
+        value_t grad = bias ? layer->db[j - layer->nout * layer->nin]
+                            : layer->dw[j];
+        value_t value = *param;
+        *param = value + eps;
+        value_t above = tapeval(denseloss(d, &input, &result, Y[s]));
+        *param = value - eps;
+        value_t below = tapeval(denseloss(d, &input, &result, Y[s]));
+        *param = value;
+        assertnearf(grad, (above - below) / (2 * eps), 1e-6);
+      }
+    }
+
+    // Input gradients are added to the tape
+    for (idx_t i = 0; i < 9; i++) {
+      value_t grad = tapegrad(in[i]);
+      value_t value = X[s][i];
+      in[i] = vfrom(value + eps);
+      value_t above = tapeval(denseloss(d, &input, &result, Y[s]));
+      in[i] = vfrom(value - eps);
+      value_t below = tapeval(denseloss(d, &input, &result, Y[s]));
+      in[i] = vfrom(value);
+      assertnearf(grad, (above - below) / (2 * eps), 1e-6);
+    }
+    tapereset(mark);
+  }
+  GRADINO_FREE(d);
+}
+
+// Filters are shared by every position: their gradients sum the contributions
+// of all positions
+static void testconv(void) {
+  conv_t convs[] = {{3, 3, 1, 2, 4, 1}, {0}};
+  len_t llens[] = {9, 16, 3};
+  net_t *n = netcreateconv(len(llens), llens, convs);
+  asserttrue(n);
+  for (idx_t s = 0; s < len(X); s++) {
+    gradcheck(n, X[s], Y[s]);
+  }
+  GRADINO_FREE(n);
+}
+
+// A pruned network computes what the dense one computes with the removed
+// weights set to zero
+static void testprune(void) {
+  len_t llens[] = {9, 8, 3};
+  tapeseed(3);
+  net_t *pruned = netcreate(len(llens), llens);
+  tapeseed(3);
+  net_t *dense = netcreate(len(llens), llens);
+  char *buf = malloc(prunesize(pruned));
+  asserttrue(pruned && dense && buf);
+  pruneinit(pruned, (len_t)prunesize(pruned), buf);
+  asserttrue(netprunetopk(pruned, 3) == 8 * 6 + 3 * 5);
+
+  for (idx_t l = 0; l < pruned->layers.len; l++) {
+    const layer_t *p = &pruned->layers.at[l];
+    const layer_t *d = &dense->layers.at[l];
+    for (idx_t i = 0; i < p->len; i++) {
+      const len_t *cols = p->cols + p->rows[i];
+      len_t nnz = p->rows[i + 1] - p->rows[i];
+      asserttrue(nnz == 3 && p->at[i].len == nnz + 1);
+      for (idx_t c = 0; c < d->nin; c++) {
+        bool kept = false;
+        for (idx_t k = 0; k < nnz; k++) {
+          kept = kept || cols[k] == c;
+        }
+        if (!kept)
+          paramset(dense, d->at[i].at[c], 0);
+      }
+      for (idx_t k = 0; k < nnz; k++) {
+        asserteqf(tapeval(p->at[i].at[k]), tapeval(d->at[i].at[cols[k]]));
+      }
+    }
+  }
+
+  idx_t mark = tapemark();
+  idx_t pin[9], pout[3], din[9], dout[3];
+  vec_t pinput, presult, dinput, dresult;
+  vecinit(&pinput, 9, pin);
+  vecinit(&presult, 3, pout);
+  vecinit(&dinput, 9, din);
+  vecinit(&dresult, 3, dout);
+  value_t pinfer[3], dinfer[3];
+  for (idx_t s = 0; s < len(X); s++) {
+    tapereset(mark);
+    for (idx_t i = 0; i < 9; i++) {
+      pin[i] = vfrom(X[s][i]);
+      din[i] = vfrom(X[s][i]);
+    }
+    netfwd(pruned, &pinput, &presult);
+    netfwd(dense, &dinput, &dresult);
+    netinfer(pruned, X[s], 1, pinfer, sizeof(inferbuf), inferbuf);
+    netinfer(dense, X[s], 1, dinfer, sizeof(inferbuf), inferbuf);
+    for (idx_t o = 0; o < 3; o++) {
+      asserteqf(tapeval(pout[o]), tapeval(dout[o]));
+      asserteqf(pinfer[o], dinfer[o]);
+      asserteqf(pinfer[o], tapeval(pout[o]));
+    }
+  }
+
+  // Fine-tuning only reaches the remaining weights
+  gradcheck(pruned, X[1], Y[1]);
+
+  // Initialization redraws the remaining weights of every perceptron
+  netrand(pruned, INIT_XAVIER);
+  for (idx_t l = 0; l < pruned->layers.len; l++) {
+    const layer_t *p = &pruned->layers.at[l];
+    value_t bound = sqrt(6.0 / (double)(p->nin + p->len));
+    for (idx_t i = 0; i < p->len; i++) {
+      const ptron_t *w = &p->at[i];
+      for (idx_t k = 0; k + 1 < w->len; k++) {
+        asserttrue(fabs(tapeval(w->at[k])) <= bound);
+      }
+      asserteqf(tapeval(w->at[w->len - 1]), 0.0);
+    }
+  }
+  tapereset(mark);
+  netinfer(pruned, X[0], 1, pinfer, sizeof(inferbuf), inferbuf);
+  for (idx_t i = 0; i < 9; i++) {
+    pin[i] = vfrom(X[0][i]);
+  }
+  netfwd(pruned, &pinput, &presult);
+  for (idx_t o = 0; o < 3; o++) {
+    asserteqf(pinfer[o], tapeval(pout[o]));
+  }
+  tapereset(mark);
+
+  free(buf);
+  GRADINO_FREE(dense);
+  GRADINO_FREE(pruned);
+}
+
+// The Hessian is symmetric: u.Hv = v.Hu
+static void testhvp(void) {
+  len_t llens[] = {9, 5, 3};
+  net_t *n = netcreate(len(llens), llens);
+  asserttrue(n);
+  fit_t fit = {0};
+  fit.inputs = &X[0][0];
+  fit.targets = &Y[0][0];
+  fit.nsamples = len(X);
+  fit.loss = LOSS_SQUARED;
+
+  static value_t u[256], v[256], hu[256], hv[256];
+  asserttrue(n->params.len <= len(u));
+  for (idx_t j = 0; j < n->params.len; j++) {
+    u[j] = sin((double)j);
+    v[j] = cos((double)j * 0.7);
+  }
+  char *buf = malloc(hvpsize(n));
+  asserttrue(buf);
+  nethvp(n, &fit, u, hu, (len_t)hvpsize(n), buf);
+  nethvp(n, &fit, v, hv, (len_t)hvpsize(n), buf);
+
+  value_t uhv = 0, vhu = 0, norm = 0;
+  for (idx_t j = 0; j < n->params.len; j++) {
+    uhv += u[j] * hv[j];
+    vhu += v[j] * hu[j];
+    norm += hu[j] * hu[j];
+  }
+  asserttrue(norm > 0);
+  assertnearf(uhv, vhu, 1e-5 * (1 + fabs(uhv)));
+
+  free(buf);
+  GRADINO_FREE(n);
+}
+
+typedef struct {
+  value_t losses[100];
+  len_t iters;
+} lbfgslog_t;
+
+static bool lbfgslog(len_t iter, value_t loss, void *ctx) {
+  lbfgslog_t *log = ctx;
+  log->losses[iter] = loss;
+  log->iters = iter + 1;
+  return true;
+}
+
+// L-BFGS never increases the loss, and fits a small full batch within a
+// hundred iterations
+static void testlbfgs(void) {
+  static const value_t T[3][3] = {
+      {0.5, -0.5, 0}, {0.1, 0.2, -0.3}, {-0.5, 0.25, 0.25}};
+  len_t llens[] = {9, 5, 3};
+  tapeseed(4);
+  net_t *n = netcreate(len(llens), llens);
+  char *buf = malloc(lbfgssize(n, 8));
+  asserttrue(n && buf);
+
+  static lbfgslog_t log;
+  fit_t fit = {0};
+  fit.inputs = &X[0][0];
+  fit.targets = &T[0][0];
+  fit.nsamples = len(X);
+  fit.epochs = len(log.losses);
+  fit.loss = LOSS_MEAN;
+  fit.onepoch = lbfgslog;
+  fit.ctx = &log;
+  value_t loss = netlbfgs(n, &fit, 8, (len_t)lbfgssize(n, 8), buf);
+
+  asserttrue(log.iters > 0);
+  for (len_t i = 1; i < log.iters; i++) {
+    asserttrue(log.losses[i] <= log.losses[i - 1]);
+  }
+  asserteqf(loss, log.losses[log.iters - 1]);
+  asserttrue(loss < 1e-6);
+
+  // The returned loss is the mean loss of the final parameters
+  value_t mean = 0;
+  for (idx_t s = 0; s < len(X); s++) {
+    value_t out[3];
+    netinfer(n, X[s], 1, out, sizeof(inferbuf), inferbuf);
+    for (idx_t o = 0; o < 3; o++) {
+      mean += (out[o] - T[s][o]) * (out[o] - T[s][o]) / 3 / (value_t)(len(X));
+    }
+  }
+  asserteqf(loss, mean);
+
+  free(buf);
+  GRADINO_FREE(n);
+}
+
+// Ensembles compute what a loop of netinfer over the models computes
+static void testensemble(void) {
+  enum { NMODELS = 5 };
+  len_t llens[] = {9, 6, 3};
+  net_t *nets[NMODELS];
+  ensemble_t *e = ensemblecreate(NMODELS, len(llens), llens);
+  asserttrue(e);
+  for (len_t m = 0; m < NMODELS; m++) {
+    tapeseed(10 + m);
+    nets[m] = netcreate(len(llens), llens);
+    asserttrue(nets[m]);
+    ensembleset(e, m, nets[m]);
+  }
+
+  for (idx_t s = 0; s < len(X); s++) {
+    value_t mean[3] = {0}, votes[3] = {0}, out[3];
+    for (len_t m = 0; m < NMODELS; m++) {
+      netinfer(nets[m], X[s], 1, out, sizeof(inferbuf), inferbuf);
+      idx_t best = 0;
+      for (idx_t o = 0; o < 3; o++) {
+        mean[o] += out[o] / NMODELS;
+        if (out[o] > out[best])
+          best = o;
+      }
+      votes[best] += 1.0 / NMODELS;
+    }
+
+    value_t result[3];
+    ensemblefwd(e, X[s], REDUCE_MEAN, result);
+    for (idx_t o = 0; o < 3; o++) {
+      asserteqf(result[o], mean[o]);
+    }
+    ensemblefwd(e, X[s], REDUCE_VOTE, result);
+    for (idx_t o = 0; o < 3; o++) {
+      asserteqf(result[o], votes[o]);
+    }
+  }
+
+  for (len_t m = 0; m < NMODELS; m++) {
+    GRADINO_FREE(nets[m]);
+  }
+  GRADINO_FREE(e);
+}
+
+int main(void) {
+  void *tapebuf = tapecreate(1 << 16);
+  asserttrue(tapebuf);
+  tapeseed(42);
+
+  testsparse();
+  testdense();
+  testconv();
+  testprune();
+  testhvp();
+  testlbfgs();
+  testensemble();
+
+  GRADINO_FREE(tapebuf);
+  return 0;
+}
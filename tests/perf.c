@@ -0,0 +1,100 @@
+// Performance counters: phases counted when the counters open, and inert
+// otherwise.
+#include "check.h"
+
+#define len(Arr) sizeof(Arr) / sizeof(Arr[0])
+
+// Run a dense and a sparse forward pass, a backward pass and a descend step
+static void work(net_t *n) {
+  idx_t in[4], out[2];
+  vec_t input, result;
+  vecinit(&input, 4, in);
+  vecinit(&result, 2, out);
+  idx_t mark = tapemark();
+  for (idx_t i = 0; i < 4; i++) {
+    in[i] = vfrom((value_t)i);
+  }
+  netfwd(n, &input, &result);
+
+  sparse_t entries[1] = {{2, vfrom(1)}};
+  svec_t sinput = {1, entries};
+  netfwdsparse(n, &sinput, &result);
+
+  tapezerograd();
+  tapebackprop(out[0]);
+  netgdstep(n, 0.01);
+  tapereset(mark);
+}
+
+static void testcounted(net_t *n) {
+  work(n);
+  perfstats_t fwd = perfstats(PERF_FWD);
+  asserttrue(fwd.calls == 2);
+  asserttrue(perfstats(PERF_BACKPROP).calls == 1);
+  asserttrue(perfstats(PERF_ZEROGRAD).calls == 1);
+  asserttrue(perfstats(PERF_GDSTEP).calls == 1);
+  // Misses may well be none on so little work
+  if (perfhas(PERF_CYCLES))
+    asserttrue(fwd.counts[PERF_CYCLES] > 0);
+  if (perfhas(PERF_INSTRUCTIONS))
+    asserttrue(fwd.counts[PERF_INSTRUCTIONS] > 0);
+
+  // Disabled counters leave the statistics as they were
+  perfenable(false);
+  work(n);
+  asserttrue(perfstats(PERF_FWD).calls == 2);
+  for (int e = 0; e < PERF_NEVENTS; e++) {
+    asserttrue(perfstats(PERF_FWD).counts[e] == fwd.counts[e]);
+  }
+  perfenable(true);
+
+  perfreset();
+  for (int p = 0; p < PERF_NPHASES; p++) {
+    perfstats_t st = perfstats((perfphase_t)p);
+    asserttrue(st.calls == 0);
+    for (int e = 0; e < PERF_NEVENTS; e++) {
+      asserttrue(st.counts[e] == 0);
+    }
+  }
+}
+
+static void testunavailable(net_t *n) {
+  for (int e = 0; e < PERF_NEVENTS; e++) {
+    asserttrue(!perfhas((perfevent_t)e));
+  }
+  perfenable(true);
+  work(n);
+  for (int p = 0; p < PERF_NPHASES; p++) {
+    perfstats_t st = perfstats((perfphase_t)p);
+    asserttrue(st.calls == 0);
+    for (int e = 0; e < PERF_NEVENTS; e++) {
+      asserttrue(st.counts[e] == 0);
+    }
+  }
+}
+
+int main(void) {
+  void *tapebuf = tapecreate(1 << 12);
+  asserttrue(tapebuf);
+  len_t llens[] = {4, 3, 2};
+  tapeseed(1);
+  net_t *n = netcreate(len(llens), llens);
+  asserttrue(n);
+
+  if (perfopen() == 0)
+    testcounted(n);
+  else
+    testunavailable(n);
+
+  FILE *out = tmpfile();
+  asserttrue(out);
+  perfreport(out, 1);
+  asserttrue(ftell(out) > 0);
+  fclose(out);
+  perfclose();
+  perfclose();
+
+  GRADINO_FREE(n);
+  GRADINO_FREE(tapebuf);
+  return 0;
+}
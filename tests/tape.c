@@ -0,0 +1,326 @@
+// Tape: interned constants, compaction, gradient accumulation, forward mode,
+// scheduled and run-grouped backpropagation, frozen segments.
+#include "check.h"
+
+#define len(Arr) sizeof(Arr) / sizeof(Arr[0])
+
+static const value_t X[4][3] = {
+    {0.5, -1.0, 0.25}, {-0.3, 0.8, 1.0}, {1.0, 0.1, -0.6}, {-0.9, -0.4, 0.2}};
+static const value_t Y[4][2] = {{0.5, -0.5}, {-1.0, 0.3}, {0.2, 0.9}, {0, 0}};
+
+static void testconst(void) {
+  idx_t zero = vconst(0);
+  asserttrue(vconst(0) == zero);
+  asserteqf(tapeval(zero), 0.0);
+
+  idx_t mark = tapemark();
+  idx_t one = vconst(1);
+  asserttrue(vconst(1) == one);
+  asserttrue(one >= mark);
+  asserttrue(vconst(0) == zero);
+
+  // Constants interned above the mark are dropped with it, the others stay
+  tapereset(mark);
+  asserttrue(vconst(0) == zero);
+  idx_t again = vconst(1);
+  asserttrue(again == mark);
+  asserteqf(tapeval(again), 1.0);
+  tapereset(mark);
+}
+
+// Compaction drops the records the root does not depend on, and keeps the
+// values and gradients of the others
+static void testcompact(void) {
+  len_t llens[] = {3, 5, 4, 2};
+  net_t *n = netcreate(len(llens), llens);
+  asserttrue(n);
+
+  idx_t mark = tapemark();
+  idx_t loss = sqloss(n, X[0], Y[0]);
+  // Dead records between live ones
+  idx_t dead = vtanh(vmul(loss, loss));
+  idx_t root = vadd(loss, vfrom(1));
+  (void)vsub(dead, root);
+
+  tapezerograd();
+  tapebackprop(root);
+  static value_t grads[256];
+  for (idx_t j = 0; j < n->params.len; j++) {
+    grads[j] = tapegrad(n->params.at[j]);
+  }
+  value_t value = tapeval(root);
+
+  static idx_t remap[1 << 12];
+  idx_t end = tapemark();
+  asserttrue(end <= len(remap));
+  len_t removed = tapecompact(mark, root, remap);
+  asserttrue(removed == 3);
+  asserttrue(tapemark() == end - removed);
+  asserttrue(remap[dead] == IDX_NONE);
+  asserttrue(remap[n->params.at[0]] == n->params.at[0]);
+
+  tapezerograd();
+  tapebackprop(remap[root]);
+  asserteqf(tapeval(remap[root]), value);
+  for (idx_t j = 0; j < n->params.len; j++) {
+    asserteqf(tapegrad(n->params.at[j]), grads[j]);
+  }
+  tapereset(mark);
+  GRADINO_FREE(n);
+}
+
+// Summing the gradients of every sample through the accumulator steps like
+// backpropagating the sum of the losses on one tape
+static void testacc(void) {
+  len_t llens[] = {3, 4, 2};
+  tapeseed(1);
+  net_t *batched = netcreate(len(llens), llens);
+  tapeseed(1);
+  net_t *accumulated = netcreate(len(llens), llens);
+  acc_t *acc = acccreate(accumulated);
+  asserttrue(batched && accumulated && acc);
+
+  idx_t mark = tapemark();
+  idx_t sum = vfrom(0);
+  for (idx_t s = 0; s < len(X); s++) {
+    sum = vadd(sum, sqloss(batched, X[s], Y[s]));
+  }
+  tapezerograd();
+  tapebackprop(sum);
+  netgdstep(batched, 0.1);
+
+  for (idx_t s = 0; s < len(X); s++) {
+    tapereset(mark);
+    idx_t loss = sqloss(accumulated, X[s], Y[s]);
+    tapezerograd();
+    tapebackprop(loss);
+    acccollect(acc, accumulated);
+  }
+  accstep(acc, accumulated, 0.1);
+  tapereset(mark);
+
+  for (idx_t j = 0; j < batched->params.len; j++) {
+    asserteqf(tapeval(accumulated->params.at[j]),
+              tapeval(batched->params.at[j]));
+  }
+  GRADINO_FREE(acc);
+  GRADINO_FREE(accumulated);
+  GRADINO_FREE(batched);
+}
+
+// The tangents of netjvp are the directional derivatives of the outputs
+static void testjvp(void) {
+  len_t llens[] = {3, 5, 4, 2};
+  net_t *n = netcreate(len(llens), llens);
+  asserttrue(n);
+  const value_t dir[3] = {0.3, -0.7, 0.2};
+  const value_t h = 1e-5;
+  dual_t din[3], dout[2];
+  value_t above[3], below[3], outabove[2], outbelow[2];
+  for (idx_t i = 0; i < 3; i++) {
+    din[i] = dfrom(X[1][i], dir[i]);
+    above[i] = X[1][i] + h * dir[i];
+    below[i] = X[1][i] - h * dir[i];
+  }
+  dvec_t input = {3, din};
+  dvec_t result = {2, dout};
+  netjvp(n, &input, &result);
+
+  static char buf[4096];
+  asserttrue(infersize(n, 1) <= sizeof(buf));
+  netinfer(n, X[1], 1, outabove, sizeof(buf), buf);
+  for (idx_t o = 0; o < 2; o++) {
+    // Values match a recorded pass
+    asserteqf(dout[o].val, outabove[o]);
+  }
+  netinfer(n, above, 1, outabove, sizeof(buf), buf);
+  netinfer(n, below, 1, outbelow, sizeof(buf), buf);
+  for (idx_t o = 0; o < 2; o++) {
+    asserteqf(dout[o].tan, (outabove[o] - outbelow[o]) / (2 * h));
+  }
+  GRADINO_FREE(n);
+}
+
+// Scheduled backpropagation matches tapebackprop, on a graph wide enough for
+// its levels to be split across threads
+static void testsched(void) {
+  len_t llens[] = {48, 600, 2};
+  net_t *n = netcreate(len(llens), llens);
+  asserttrue(n);
+
+  value_t x[48];
+  for (idx_t i = 0; i < len(x); i++) {
+    x[i] = sin((double)i);
+  }
+  idx_t mark = tapemark();
+  idx_t loss = sqloss(n, x, Y[0]);
+  idx_t end = tapemark();
+
+  tapezerograd();
+  tapebackprop(loss);
+  static value_t grads[1 << 18];
+  asserttrue(end <= len(grads));
+  for (idx_t i = 0; i < end; i++) {
+    grads[i] = tapegrad(i);
+  }
+
+  sched_t *s = schedcreate(loss);
+  asserttrue(s);
+  tapezerograd();
+  schedbackprop(s, NULL);
+  for (idx_t i = 0; i < end; i++) {
+    asserteqf(tapegrad(i), grads[i]);
+  }
+
+#ifdef GRADINO_POSIX
+  // A schedule of the root alone has no level to split
+  idx_t leaf = vfrom(2);
+  sched_t *single = schedcreate(leaf);
+  asserttrue(single && single->nlevels == 1);
+
+  schedpool_t pool;
+  asserttrue(schedstart(&pool, 3) == 0);
+  // The pool is reused across calls, whatever their schedules
+  for (int call = 0; call < 3; call++) {
+    tapezerograd();
+    schedbackprop(single, &pool);
+    asserteqf(tapegrad(leaf), 1.0);
+    schedbackprop(single, &pool);
+    schedbackprop(s, &pool);
+    for (idx_t i = 0; i < end; i++) {
+      asserteqf(tapegrad(i), grads[i]);
+    }
+  }
+  schedstop(&pool);
+  GRADINO_FREE(single);
+#endif
+
+  tapereset(mark);
+  GRADINO_FREE(s);
+  GRADINO_FREE(n);
+}
+
+#ifdef GRADINO_POSIX
+typedef struct {
+  const net_t *net;
+  const seg_t *seg;
+  idx_t zero;
+  value_t out[4][2];
+} freezer_t;
+
+// Forward passes on a tape of its own, over the frozen parameters
+static void *freezework(void *arg) {
+  freezer_t *f = arg;
+  void *tapebuf = tapecreate(1 << 10);
+  char *viewbuf = malloc(netviewsize(f->net));
+  asserttrue(tapebuf && viewbuf);
+  tapeattach(f->seg);
+  // Records follow the segment, whose constants are still interned
+  asserttrue(tapemark() == f->seg->len);
+  asserttrue(vconst(0) == f->zero);
+
+  net_t local;
+  netview(&local, f->net, (len_t)netviewsize(f->net), viewbuf);
+  idx_t in[3], out[2];
+  vec_t input, result;
+  vecinit(&input, 3, in);
+  vecinit(&result, 2, out);
+  for (idx_t s = 0; s < len(X); s++) {
+    tapereset(f->seg->len);
+    for (idx_t i = 0; i < 3; i++) {
+      in[i] = vfrom(X[s][i]);
+    }
+    netfwd(&local, &input, &result);
+    for (idx_t o = 0; o < 2; o++) {
+      f->out[s][o] = tapeval(out[o]);
+    }
+  }
+
+  free(viewbuf);
+  GRADINO_FREE(tapebuf);
+  return NULL;
+}
+
+// Threads attached to a frozen network compute what it computes on the tape
+// it was trained on
+static void testfreeze(void) {
+  enum { NTHREADS = 4 };
+  idx_t zero = vconst(0);
+  len_t llens[] = {3, 5, 4, 2};
+  net_t *n = netcreate(len(llens), llens);
+  asserttrue(n);
+
+  idx_t mark = tapemark();
+  value_t expected[4][2];
+  idx_t in[3], out[2];
+  vec_t input, result;
+  vecinit(&input, 3, in);
+  vecinit(&result, 2, out);
+  for (idx_t s = 0; s < len(X); s++) {
+    for (idx_t i = 0; i < 3; i++) {
+      in[i] = vfrom(X[s][i]);
+    }
+    netfwd(n, &input, &result);
+    for (idx_t o = 0; o < 2; o++) {
+      expected[s][o] = tapeval(out[o]);
+    }
+  }
+  tapereset(mark);
+
+  seg_t seg = netfreeze(n);
+  asserttrue(seg.len == mark);
+  pthread_t threads[NTHREADS];
+  static freezer_t freezers[NTHREADS];
+  for (int t = 0; t < NTHREADS; t++) {
+    freezers[t].net = n;
+    freezers[t].seg = &seg;
+    freezers[t].zero = zero;
+    asserttrue(pthread_create(&threads[t], NULL, freezework, &freezers[t]) ==
+               0);
+  }
+  for (int t = 0; t < NTHREADS; t++) {
+    asserttrue(pthread_join(threads[t], NULL) == 0);
+    for (idx_t s = 0; s < len(X); s++) {
+      for (idx_t o = 0; o < 2; o++) {
+        asserteqf(freezers[t].out[s][o], expected[s][o]);
+      }
+    }
+  }
+  GRADINO_FREE(n);
+}
+#endif
+
+// Backpropagation dispatched by runs of records of the same type matches
+// central differences, down to perceptrons over a single input
+static void testbackprop(void) {
+  len_t wide[] = {3, 5, 4, 2};
+  len_t narrow[] = {1, 3, 2};
+  net_t *n = netcreate(len(wide), wide);
+  net_t *single = netcreate(len(narrow), narrow);
+  asserttrue(n && single);
+  for (idx_t s = 0; s < len(X); s++) {
+    gradcheck(n, X[s], Y[s]);
+    gradcheck(single, X[s], Y[s]);
+  }
+  GRADINO_FREE(single);
+  GRADINO_FREE(n);
+}
+
+int main(void) {
+  void *tapebuf = tapecreate(1 << 18);
+  asserttrue(tapebuf);
+  tapeseed(42);
+
+  testconst();
+  testcompact();
+  testacc();
+  testjvp();
+  testsched();
+  testbackprop();
+#ifdef GRADINO_POSIX
+  testfreeze();
+#endif
+
+  GRADINO_FREE(tapebuf);
+  return 0;
+}
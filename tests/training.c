@@ -0,0 +1,406 @@
+// Training: minibatches, shuffling, background feeds, learning rate schedules
+// and early stopping, streaming statistics, arenas.
+#include "check.h"
+
+#define len(Arr) sizeof(Arr) / sizeof(Arr[0])
+
+enum { NIN = 4, NOUT = 2 };
+
+static const value_t X[4][NIN] = {{0.5, -1.0, 0.25, 0.0},
+                                  {-0.3, 0.8, 1.0, 0.5},
+                                  {1.0, 0.1, -0.6, -0.2},
+                                  {-0.9, -0.4, 0.2, 0.7}};
+static const value_t Y[4][NOUT] = {
+    {0.5, -0.5}, {-0.8, 0.3}, {0.2, 0.9}, {0.6, -0.1}};
+
+// Validation targets that training moves away from
+static const value_t V[4][NOUT] = {
+    {-0.5, 0.5}, {0.8, -0.3}, {-0.2, -0.9}, {-0.6, 0.1}};
+
+// Train a network created with the given seed, and return it
+static net_t *fitseeded(uint64_t seed, fit_t *fit) {
+  len_t llens[] = {NIN, 6, NOUT};
+  tapeseed(seed);
+  net_t *n = netcreate(len(llens), llens);
+  char *buf = malloc(fitsize(n, fit));
+  asserttrue(n && buf);
+  netfit(n, fit, (len_t)fitsize(n, fit), buf);
+  free(buf);
+  return n;
+}
+
+static bool sameparams(const net_t *a, const net_t *b) {
+  for (idx_t j = 0; j < a->params.len; j++) {
+    if (fabs(tapeval(a->params.at[j]) - tapeval(b->params.at[j])) > 1e-6)
+      return false;
+  }
+  return true;
+}
+
+// Minibatches step once per batch with the summed gradients of its samples,
+// the last batch taking the remaining samples
+static void testbatch(void) {
+  enum { EPOCHS = 3, BATCH = 3 };
+  fit_t fit = {0};
+  fit.inputs = &X[0][0];
+  fit.targets = &Y[0][0];
+  fit.nsamples = len(X);
+  fit.epochs = EPOCHS;
+  fit.batch = BATCH;
+  fit.rate = 0.05;
+  fit.loss = LOSS_SQUARED;
+  net_t *fitted = fitseeded(1, &fit);
+
+  len_t llens[] = {NIN, 6, NOUT};
+  tapeseed(1);
+  net_t *n = netcreate(len(llens), llens);
+  asserttrue(n);
+  idx_t mark = tapemark();
+  for (len_t epoch = 0; epoch < EPOCHS; epoch++) {
+    for (idx_t from = 0; from < len(X); from += BATCH) {
+      tapereset(mark);
+      idx_t sum = vfrom(0);
+      for (idx_t s = from; s < len(X) && s < from + BATCH; s++) {
+        sum = vadd(sum, sqloss(n, X[s], Y[s]));
+      }
+      tapezerograd();
+      tapebackprop(sum);
+      netgdstep(n, fit.rate);
+    }
+  }
+  tapereset(mark);
+  asserttrue(sameparams(fitted, n));
+
+  GRADINO_FREE(n);
+  GRADINO_FREE(fitted);
+}
+
+// Shuffling draws its orders from the tape generator: the same seed trains
+// the same network. A full batch does not depend on the order, and single
+// samples do.
+static void testshuffle(void) {
+  fit_t fit = {0};
+  fit.inputs = &X[0][0];
+  fit.targets = &Y[0][0];
+  fit.nsamples = len(X);
+  fit.epochs = 5;
+  fit.rate = 0.05;
+  fit.loss = LOSS_SQUARED;
+
+  fit.batch = len(X);
+  net_t *ordered = fitseeded(2, &fit);
+  fit.shuffle = true;
+  net_t *shuffled = fitseeded(2, &fit);
+  asserttrue(sameparams(ordered, shuffled));
+  GRADINO_FREE(shuffled);
+  GRADINO_FREE(ordered);
+
+  fit.batch = 1;
+  fit.shuffle = false;
+  ordered = fitseeded(2, &fit);
+  fit.shuffle = true;
+  shuffled = fitseeded(2, &fit);
+  net_t *again = fitseeded(2, &fit);
+  asserttrue(!sameparams(ordered, shuffled));
+  asserttrue(sameparams(shuffled, again));
+  GRADINO_FREE(again);
+  GRADINO_FREE(shuffled);
+  GRADINO_FREE(ordered);
+}
+
+#ifdef GRADINO_POSIX
+typedef struct {
+  len_t next;
+  len_t nrows;
+} rows_t;
+
+// Rows numbered in order, with targets the negated numbers
+static len_t fillrows(value_t *inputs, value_t *targets, len_t count,
+                      void *ctx) {
+  rows_t *r = ctx;
+  len_t n = 0;
+  for (; n < count && r->next < r->nrows; n++, r->next++) {
+    for (idx_t i = 0; i < NIN; i++) {
+      inputs[n * NIN + i] = (value_t)(r->next * NIN + i);
+    }
+    for (idx_t o = 0; o < NOUT; o++) {
+      targets[n * NOUT + o] = -(value_t)(r->next * NOUT + o);
+    }
+  }
+  return n;
+}
+
+// The feed hands out every row once and in order, then keeps reporting the
+// end. Stopping it with the ring full does not wait for the data to run out.
+static void testfeed(void) {
+  enum { NSLOTS = 3, BATCH = 4, NROWS = 50 };
+  char *buf = malloc(feedsize(NSLOTS, BATCH, NIN, NOUT));
+  asserttrue(buf);
+
+  rows_t rows = {0, NROWS};
+  feed_t feed;
+  feedinit(&feed, NSLOTS, BATCH, NIN, NOUT, fillrows, &rows,
+           (len_t)feedsize(NSLOTS, BATCH, NIN, NOUT), buf);
+  asserttrue(feedstart(&feed) == 0);
+  const value_t *x, *y;
+  len_t count, row = 0;
+  while (feednext(&feed, &x, &y, &count)) {
+    asserttrue(count == BATCH || row + count == NROWS);
+    for (idx_t r = 0; r < count; r++, row++) {
+      for (idx_t i = 0; i < NIN; i++) {
+        asserteqf(x[r * NIN + i], (value_t)(row * NIN + i));
+      }
+      for (idx_t o = 0; o < NOUT; o++) {
+        asserteqf(y[r * NOUT + o], -(value_t)(row * NOUT + o));
+      }
+    }
+  }
+  asserttrue(row == NROWS);
+  asserttrue(!feednext(&feed, &x, &y, &count));
+  feedstop(&feed);
+
+  rows.next = 0;
+  rows.nrows = (len_t)-1;
+  feedinit(&feed, NSLOTS, BATCH, NIN, NOUT, fillrows, &rows,
+           (len_t)feedsize(NSLOTS, BATCH, NIN, NOUT), buf);
+  asserttrue(feedstart(&feed) == 0);
+  asserttrue(feednext(&feed, &x, &y, &count) && count == BATCH);
+  asserteqf(x[0], 0.0);
+  feedstop(&feed);
+  free(buf);
+}
+#endif
+
+static char inferbuf[1 << 12];
+
+// Mean squared error on the validation split, as netfit evaluates it
+static value_t validloss(const net_t *n) {
+  value_t sum = 0;
+  for (idx_t s = 0; s < len(X); s++) {
+    value_t out[NOUT];
+    netinfer(n, X[s], 1, out, sizeof(inferbuf), inferbuf);
+    for (idx_t o = 0; o < NOUT; o++) {
+      sum += (V[s][o] - out[o]) * (V[s][o] - out[o]);
+    }
+  }
+  return sum / (value_t)(len(X));
+}
+
+typedef struct {
+  const net_t *net;
+  value_t losses[500];
+  len_t epochs;
+} history_t;
+
+static bool record(len_t epoch, value_t loss, void *ctx) {
+  (void)loss;
+  history_t *h = ctx;
+  h->losses[epoch] = validloss(h->net);
+  h->epochs = epoch + 1;
+  return true;
+}
+
+// Training stops patience epochs after the best validation loss, and leaves
+// the parameters of that epoch
+static void testearlystop(void) {
+  enum { EPOCHS = 500, PATIENCE = 5 };
+  len_t llens[] = {NIN, 6, NOUT};
+  net_t *n = netcreate(len(llens), llens);
+  asserttrue(n);
+
+  static history_t h;
+  h.net = n;
+  fit_t fit = {0};
+  fit.inputs = &X[0][0];
+  fit.targets = &Y[0][0];
+  fit.nsamples = len(X);
+  fit.epochs = EPOCHS;
+  fit.batch = 1;
+  fit.rate = 0.05;
+  fit.loss = LOSS_SQUARED;
+  fit.vinputs = &X[0][0];
+  fit.vtargets = &V[0][0];
+  fit.nvalid = len(X);
+  fit.patience = PATIENCE;
+  fit.onepoch = record;
+  fit.ctx = &h;
+
+  char *buf = malloc(fitsize(n, &fit));
+  asserttrue(buf);
+  value_t loss = netfit(n, &fit, (len_t)fitsize(n, &fit), buf);
+
+  len_t best = 0;
+  for (len_t e = 1; e < h.epochs; e++) {
+    if (h.losses[e] < h.losses[best])
+      best = e;
+  }
+  asserttrue(h.epochs < EPOCHS);
+  asserttrue(h.epochs == best + PATIENCE + 1);
+  asserteqf(validloss(n), h.losses[best]);
+  asserteqf(loss, h.losses[best]);
+
+  free(buf);
+  GRADINO_FREE(n);
+}
+
+// Warmup ramps up to the rate, then the decay follows its schedule
+static void testfitrate(void) {
+  fit_t fit = {0};
+  fit.epochs = 13;
+  fit.rate = 0.1;
+  fit.warmup = 4;
+  for (len_t e = 0; e < fit.warmup; e++) {
+    asserteqf(fitrate(&fit, e), 0.1 * (double)(e + 1) / 4);
+  }
+  asserteqf(fitrate(&fit, 12), 0.1);
+
+  fit.decay = DECAY_STEP;
+  fit.decayevery = 3;
+  fit.decayrate = 0.5;
+  asserteqf(fitrate(&fit, 4), 0.1);
+  asserteqf(fitrate(&fit, 6), 0.1);
+  asserteqf(fitrate(&fit, 7), 0.05);
+  asserteqf(fitrate(&fit, 12), 0.025);
+
+  // From the full rate after the warmup down to zero at the last epoch
+  fit.decay = DECAY_COSINE;
+  asserteqf(fitrate(&fit, 4), 0.1);
+  asserteqf(fitrate(&fit, 8), 0.05);
+  asserteqf(fitrate(&fit, 12), 0.0);
+  for (len_t e = 5; e < fit.epochs; e++) {
+    asserttrue(fitrate(&fit, e) < fitrate(&fit, e - 1));
+  }
+  fit.epochs = 5;
+  asserteqf(fitrate(&fit, 4), 0.1);
+}
+
+// Rolling statistics cover the last window losses, or every loss before the
+// window fills up
+static void teststream(void) {
+  enum { WINDOW = 8, STEPS = 21 };
+  len_t llens[] = {NIN, 5, NOUT};
+  net_t *n = netcreate(len(llens), llens);
+  char *buf = malloc(streamsize(n, WINDOW));
+  asserttrue(n && buf);
+
+  stream_t s;
+  idx_t mark = tapemark();
+  streaminit(&s, n, 0.05, LOSS_SQUARED, WINDOW, (len_t)streamsize(n, WINDOW),
+             buf);
+
+  value_t losses[STEPS];
+  idx_t end = 0;
+  for (idx_t step = 0; step < STEPS; step++) {
+    losses[step] = streamstep(&s, n, X[step % len(X)], Y[step % len(Y)]);
+    // The graph of every sample is recorded from the same mark
+    if (step == 0)
+      end = tapemark();
+    asserttrue(tapemark() == end && end > mark);
+
+    idx_t count = step + 1 < WINDOW ? step + 1 : WINDOW;
+    value_t mean = 0, var = 0;
+    for (idx_t i = step + 1 - count; i <= step; i++) {
+      mean += losses[i] / (value_t)count;
+    }
+    for (idx_t i = step + 1 - count; i <= step; i++) {
+      var += (losses[i] - mean) * (losses[i] - mean) / (value_t)count;
+    }
+
+    value_t smean, sdev;
+    streamstats(&s, &smean, &sdev);
+    asserteqf(smean, mean);
+    asserteqf(sdev, sqrt(var));
+  }
+
+  free(buf);
+  GRADINO_FREE(n);
+}
+
+// Whether a region of n bytes starts on a cache line and lies in a buffer
+static bool within(const char *region, size_t n, const char *buf,
+                   size_t nbuf) {
+  return (uintptr_t)region % 64 == 0 && region >= buf &&
+         region + n <= buf + nbuf;
+}
+
+// An arena lays out every region of a model on its own cache lines, within the
+// buffer, however the buffer is aligned, and its tape holds the steps it was
+// sized for. Replaces the tape of the calling thread, so it runs last.
+static void testarena(void) {
+  len_t llens[] = {NIN, 6, NOUT};
+  arena_t arena = {0};
+  arena.nlens = len(llens);
+  arena.llens = llens;
+  // Inputs, squared errors and the running sum of a sample
+  arena.records = NIN + 4 * NOUT + 3;
+  arena.samples = len(X);
+  arena.acc = true;
+  arena.fit = len(X);
+  arena.infer = 3;
+
+  size_t nbuf = arenasize(&arena);
+  char *buf = malloc(nbuf + 1);
+  asserttrue(buf);
+  // Off by one byte from any alignment malloc guarantees
+  arenainit(&arena, (len_t)nbuf, buf + 1);
+  net_t *n = &arena.net;
+
+  char *start = buf + 1;
+  asserttrue(within((const char *)n->layers.at, 0, start, nbuf));
+  asserttrue(within((const char *)arena.accum.at,
+                    sizeof(value_t) * arena.accum.len, start, nbuf));
+  asserttrue(arena.accum.len == n->params.len);
+  asserttrue(within(arena.fitbuf, arena.nfitbuf, start, nbuf));
+  asserttrue(within(arena.inferbuf, arena.ninferbuf, start, nbuf));
+  asserttrue((char *)(arena.accum.at + arena.accum.len) <= arena.fitbuf);
+  asserttrue(arena.fitbuf + arena.nfitbuf <= arena.inferbuf);
+
+  fit_t fit = {0};
+  fit.inputs = &X[0][0];
+  fit.targets = &Y[0][0];
+  fit.nsamples = len(X);
+  fit.epochs = 2;
+  fit.batch = 2;
+  fit.rate = 0.05;
+  fit.loss = LOSS_SQUARED;
+  asserttrue(arena.nfitbuf >= fitsize(n, &fit));
+  asserttrue(arena.ninferbuf >= infersize(n, 3));
+
+  // The parameters and the interned zero live below every step
+  asserttrue(tapemark() == n->params.len + 1);
+  idx_t mark = tapemark();
+  netfit(n, &fit, arena.nfitbuf, arena.fitbuf);
+  // Every sample of a step recorded at once, along with their losses
+  idx_t sum = vfrom(0);
+  for (idx_t s = 0; s < len(X); s++) {
+    sum = vadd(sum, sqloss(n, X[s], Y[s]));
+  }
+  tapezerograd();
+  tapebackprop(sum);
+  acccollect(&arena.accum, n);
+  accstep(&arena.accum, n, 0.05);
+  tapereset(mark);
+
+  value_t out[3][NOUT];
+  netinfer(n, &X[0][0], 3, &out[0][0], arena.ninferbuf, arena.inferbuf);
+  free(buf);
+}
+
+int main(void) {
+  void *tapebuf = tapecreate(1 << 14);
+  asserttrue(tapebuf);
+  tapeseed(42);
+
+  testbatch();
+  testshuffle();
+#ifdef GRADINO_POSIX
+  testfeed();
+#endif
+  testfitrate();
+  testearlystop();
+  teststream();
+  testarena();
+
+  GRADINO_FREE(tapebuf);
+  return 0;
+}